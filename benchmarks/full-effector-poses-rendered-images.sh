@@ -1,5 +1,21 @@
 #!/usr/bin/env bash
 
+# Runs hpm on rendered images of the effector, where we know the true position.
+# Writes tmp/benchmark.json with the position error of each image,
+# hpm latency percentiles over all runs, and hpm's peak memory use.
+# What hpm writes to standard error goes to tmp/benchmark.err, so only its
+# standard output is parsed for the position.
+# Exits with an error if the accuracy or speed got worse than the thresholds below.
+#
+# Doesn't compile hpm. Build it first, or say
+# REBUILD=true ./full-effector-poses-rendered-images.sh
+#
+# Each image is analysed RUNS times (default 5) to get stable latencies:
+# RUNS=20 ./full-effector-poses-rendered-images.sh
+#
+# Override the thresholds like
+# MAX_POSITION_ERROR_MM=0.5 MAX_P90_LATENCY_S=2.0 ./full-effector-poses-rendered-images.sh
+
 set -o errexit
 set -o pipefail
 
@@ -7,22 +23,122 @@ readonly BINPATH="$(dirname "$0")"
 readonly HPMPATH="${BINPATH}/../hpm"
 readonly TMPDIR="${BINPATH}/tmp"
 mkdir -p "${TMPDIR}/"
-readonly TMPFILE=$(mktemp -p "${TMPDIR}/" XXXXXXXXXX)
+readonly RESULTS="${TMPDIR}/benchmark.tsv"
+readonly JSON="${TMPDIR}/benchmark.json"
+readonly ERRORS="${TMPDIR}/benchmark.err"
+
+readonly RUNS="${RUNS:-5}"
+readonly MAX_POSITION_ERROR_MM="${MAX_POSITION_ERROR_MM:-1.0}"
+readonly MAX_P90_LATENCY_S="${MAX_P90_LATENCY_S:-}"
 
-# Rebuild hpm binary
-pushd "${HPMPATH}" >/dev/null
-b
-popd >/dev/null
+readonly HPM="${HPMPATH}/hpm/hpm"
+readonly TEST_IMAGES="${HPMPATH}/hpm/test-images"
 
-readonly IMAGE="${HPMPATH}/hpm/test-images/generated_benchmark_nr6_32_elevated_150p43_0_0_0_30_0_0_1500.png"
-readonly COMMAND="${HPMPATH}/hpm/hpm ${HPMPATH}/hpm/example-cam-params/openscadHandCodedCamParamsRotX30.xml ${BINPATH}/cam-params/elevated-marker-params-openscad.xml ${IMAGE}"
-readonly OUT=$(${COMMAND} 2>&1 | tee ${TMPFILE})
+# <image> <cam params> <marker params> <true x> <true y> <true z>
+readonly CASES=(
+	"${TEST_IMAGES}/generated_benchmark_nr6_32_elevated_150p43_0_0_0_30_0_0_1500.png ${HPMPATH}/hpm/example-cam-params/openscadHandCodedCamParamsRotX30.xml ${BINPATH}/cam-params/elevated-marker-params-openscad.xml 0 0 0"
+)
 
-n_lines=$(wc -l ${TMPFILE} | awk '{ print $1 }')
-if [ 1 -ne $n_lines ]; then
-	echo "Error: found ${n_lines} lines of output. Expected 1. See the temporary file ${TMPFILE} for details"
-	exit 1
+if [ ${REBUILD} ]; then
+	pushd "${HPMPATH}" >/dev/null
+	b
+	popd >/dev/null
 fi
-error=$(octave --eval "norm(${OUT::-1})" | sed -E 's/ans = (.+)/\1/g')
-echo "Analyzed image ${IMAGE}:"
-echo "Found a position ${error} mm from the origin"
+
+# Print the time and output of one hpm run, like
+# "<seconds> <peak kB> <1 if stderr warned, else 0> <output>".
+# Peak memory needs GNU time. It's reported as 0 without it.
+# The run's standard error is appended to ${ERRORS}.
+run_hpm() {
+	local -r OUTFILE=$(mktemp -p "${TMPDIR}/" XXXXXXXXXX)
+	local PEAK_KB=0
+	local -r START_NS=$(date +%s%N)
+	if [ -x /usr/bin/time ]; then
+		/usr/bin/time -f "%M" -o "${OUTFILE}.time" "${HPM}" "$@" >"${OUTFILE}" 2>"${OUTFILE}.err" || true
+		PEAK_KB=$(tail -n 1 "${OUTFILE}.time")
+	else
+		"${HPM}" "$@" >"${OUTFILE}" 2>"${OUTFILE}.err" || true
+	fi
+	local -r END_NS=$(date +%s%N)
+	local WARNED=0
+	if grep -q Warning "${OUTFILE}.err"; then
+		WARNED=1
+	fi
+	if [ -s "${OUTFILE}.err" ]; then
+		echo "hpm $*" >>"${ERRORS}"
+		cat "${OUTFILE}.err" >>"${ERRORS}"
+	fi
+	echo "$(((END_NS - START_NS) / 1000))e-6 ${PEAK_KB} ${WARNED} $(tr '\n' ' ' <"${OUTFILE}")"
+	rm -f "${OUTFILE}" "${OUTFILE}.time" "${OUTFILE}.err"
+}
+
+: >"${RESULTS}"
+: >"${ERRORS}"
+for CASE in "${CASES[@]}"; do
+	read -r IMAGE CAMPARAMS MARKERPARAMS TRUE_X TRUE_Y TRUE_Z <<<"${CASE}"
+	echo "Analyzing ${IMAGE}"
+	for ((RUN = 1; RUN <= RUNS; RUN++)); do
+		read -r SECONDS_TAKEN PEAK_KB WARNED OUT <<<"$(run_hpm "${CAMPARAMS}" "${MARKERPARAMS}" "${IMAGE}")"
+		printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "${IMAGE}" "${TRUE_X}" "${TRUE_Y}" "${TRUE_Z}" "${SECONDS_TAKEN}" "${PEAK_KB}" "${WARNED}" "${OUT}" >>"${RESULTS}"
+	done
+done
+
+python3 - "${RESULTS}" "${JSON}" <<EOP
+import json
+import math
+import re
+import sys
+
+images = {}
+latencies = []
+peak_kb = 0
+with open(sys.argv[1]) as f:
+    for line in f:
+        image, x, y, z, seconds, kb, warned, out = line.rstrip("\n").split("\t")
+        latencies.append(float(seconds))
+        peak_kb = max(peak_kb, int(kb))
+        result = images.setdefault(image, {"runs": 0, "failures": 0, "output": out.strip()})
+        result["runs"] += 1
+        numbers = re.findall(r"-?\d+(?:\.\d+)?(?:[eE][-+]?\d+)?", out)
+        if len(numbers) != 3 or "Warning" in out or warned == "1":
+            result["failures"] += 1
+            continue
+        error = math.dist([float(n) for n in numbers], [float(x), float(y), float(z)])
+        result["position_error_mm"] = max(result.get("position_error_mm", 0.0), error)
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))]
+
+
+report = {
+    "images": images,
+    "latency_s": {
+        "p50": percentile(latencies, 50),
+        "p90": percentile(latencies, 90),
+        "p99": percentile(latencies, 99),
+        "max": max(latencies),
+    },
+    "peak_rss_kb": peak_kb,
+}
+failed = []
+for image, result in images.items():
+    if result["failures"] > 0:
+        failed.append("no position found in " + image + ": " + result["output"])
+    elif result["position_error_mm"] > ${MAX_POSITION_ERROR_MM}:
+        failed.append("position_error_mm of " + image)
+max_p90_latency_s = "${MAX_P90_LATENCY_S}"
+if max_p90_latency_s and report["latency_s"]["p90"] > float(max_p90_latency_s):
+    failed.append("latency_s p90")
+report["passed"] = not failed
+report["failed"] = failed
+
+with open(sys.argv[2], "w") as f:
+    json.dump(report, f, indent=2)
+print(json.dumps(report, indent=2))
+for reason in failed:
+    print("FAIL: " + reason)
+sys.exit(1 if failed else 0)
+EOP
+echo "PASS"
@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+
+# Calibrate on the rendered OpenScad frames, and compare the result with
+# openscadCamParams.xml.
+# Prints a JSON profile with the time spent in each stage, peak memory use,
+# and the differences to the reference.
+# Exits with an error if the accuracy got worse than the thresholds below.
+#
+# Extra arguments are passed on to calibrate_camera_charucoRO, like
+# ./benchmark.sh --jobs=1
+# ./benchmark.sh --sparse_ro
+#
+# Set MAX_WALL_TIME_S to also fail on a speed regression, like
+# MAX_WALL_TIME_S=60 ./benchmark.sh
+#
+# Set FIXED_BOARD=true to benchmark the build with the board fixed at compile
+# time instead. compare_fixed_board.sh runs both.
+
+set -o errexit
+set -o pipefail
+
+readonly THISPATH="$(dirname "$0")"
+readonly TMPDIR="${THISPATH}/tmp"
+mkdir -p "${TMPDIR}/"
+
+readonly MAX_REPROJECTION_ERROR="0.25"
+readonly MAX_FOCAL_LENGTH_ERROR_PX="2.0"
+readonly MAX_PRINCIPAL_POINT_ERROR_PX="2.0"
+readonly MAX_DISTORTION_COEFFICIENT_ERROR="0.01"
+
+if [ "${FIXED_BOARD}" == "true" ]; then
+	readonly MAKE_ARGS="--fixed-board"
+	readonly BINARY="calibrate_camera_charucoRO_fixed_board"
+	readonly PROFILE="benchmark_fixed_board.json"
+else
+	readonly MAKE_ARGS=""
+	readonly BINARY="calibrate_camera_charucoRO"
+	readonly PROFILE="benchmark.json"
+fi
+
+pushd "${THISPATH}/.." >/dev/null
+./make ${MAKE_ARGS}
+popd >/dev/null
+
+pushd "${THISPATH}" >/dev/null
+"../${BINARY}" --dictionary=16 \
+	--squares_x=16 \
+	--squares_y=11 \
+	--square_side_length=90.0 \
+	--marker_side_length=70.0 \
+	--images_list=./pics_list.xml \
+	--refind_strategy \
+	--detector_params=../detector_params.yml \
+	--grid_width=1260.0 \
+	--profile="tmp/${PROFILE}" \
+	--reference=openscadCamParams.xml \
+	"$@" \
+	tmp/benchmarkCamParams.xml >tmp/benchmark.log
+popd >/dev/null
+
+cat "${TMPDIR}/${PROFILE}"
+
+python3 - "${TMPDIR}/${PROFILE}" <<EOP
+import json
+import sys
+
+with open(sys.argv[1]) as f:
+    profile = json.load(f)
+results = profile["results"]
+limits = {
+    "reprojection_error": ${MAX_REPROJECTION_ERROR},
+    "focal_length_error_px": ${MAX_FOCAL_LENGTH_ERROR_PX},
+    "principal_point_error_px": ${MAX_PRINCIPAL_POINT_ERROR_PX},
+    "distortion_coefficient_error": ${MAX_DISTORTION_COEFFICIENT_ERROR},
+}
+failed = [name for name, limit in limits.items() if results[name] > limit]
+max_wall_time_s = "${MAX_WALL_TIME_S}"
+if max_wall_time_s and profile["wall_time_s"] > float(max_wall_time_s):
+    failed.append("wall_time_s")
+for name in failed:
+    print("FAIL: " + name)
+sys.exit(1 if failed else 0)
+EOP
+echo "PASS"
@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+
+# Compare the build with the board fixed at compile time against the default
+# build, on the rendered OpenScad frames.
+# Runs benchmark.sh RUNS times (default 3) for each build, and prints the
+# fastest wall time, calibrateCameraRO stage time and peak memory of each.
+# Exits with an error if the two builds don't calibrate to the same result.
+#
+# Extra arguments are passed on to benchmark.sh, like
+# ./compare_fixed_board.sh --sparse_ro
+# RUNS=10 ./compare_fixed_board.sh
+
+set -o errexit
+set -o pipefail
+
+readonly THISPATH="$(dirname "$0")"
+readonly TMPDIR="${THISPATH}/tmp"
+readonly RUNS="${RUNS:-3}"
+mkdir -p "${TMPDIR}/"
+
+for run in $(seq "${RUNS}"); do
+	"${THISPATH}/benchmark.sh" "$@" >/dev/null
+	cp "${TMPDIR}/benchmark.json" "${TMPDIR}/compare_dynamic_${run}.json"
+	FIXED_BOARD=true "${THISPATH}/benchmark.sh" "$@" >/dev/null
+	cp "${TMPDIR}/benchmark_fixed_board.json" "${TMPDIR}/compare_fixed_board_${run}.json"
+done
+
+python3 - "${TMPDIR}" "${RUNS}" <<EOP
+import json
+import sys
+
+tmpdir, runs = sys.argv[1], int(sys.argv[2])
+
+
+def load(name):
+    profiles = []
+    for run in range(1, runs + 1):
+        with open("{}/compare_{}_{}.json".format(tmpdir, name, run)) as f:
+            profiles.append(json.load(f))
+    return profiles
+
+
+def fastest(profiles):
+    return {
+        "wall_time_s": min(p["wall_time_s"] for p in profiles),
+        "calibrateCameraRO_s": min(p["stages"]["calibrateCameraRO"]["time_s"] for p in profiles),
+        "peak_rss_kb": min(p["peak_rss_kb"] for p in profiles),
+    }
+
+
+dynamic, fixed = load("dynamic"), load("fixed_board")
+summary = {"runs": runs, "dynamic": fastest(dynamic), "fixed_board": fastest(fixed)}
+summary["dynamic_over_fixed_board"] = {
+    name: summary["dynamic"][name] / summary["fixed_board"][name]
+    for name in summary["dynamic"]
+    if summary["fixed_board"][name] > 0
+}
+differences = {
+    name: abs(value - fixed[0]["results"][name])
+    for name, value in dynamic[0]["results"].items()
+    if name not in ("fixed_board", "jobs") and name in fixed[0]["results"]
+}
+summary["max_result_difference"] = max(differences.values())
+print(json.dumps(summary, indent=2))
+failed = [name for name, difference in differences.items() if difference > 1e-9]
+for name in failed:
+    print("FAIL: fixed board result differs in " + name)
+sys.exit(1 if failed else 0)
+EOP
+echo "PASS"
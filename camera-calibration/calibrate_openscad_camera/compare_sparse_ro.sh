@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+
+# Compare --sparse_ro against calibrateCameraRO on the rendered OpenScad frames.
+# Runs benchmark.sh with each solver, and prints the camera parameters and the
+# four board corners that calibrate_camera_charucoRO prints, for both.
+# Exits with an error if they differ by more than
+# MAX_INTRINSICS_DIFFERENCE_PX (default 0.1) in fx, fy, cx or cy,
+# MAX_DISTORTION_DIFFERENCE (default 0.001) in any distortion coefficient, or
+# MAX_BOARD_CORNER_DIFFERENCE (default 0.05, in square_side_length units) in any board corner coordinate.
+# The reprojection error on these frames is about 0.22 px, so the defaults
+# ask the two solvers to agree well within it.
+#
+# Extra arguments are passed on to benchmark.sh, like
+# ./compare_sparse_ro.sh --jobs=1
+# FIXED_BOARD=true ./compare_sparse_ro.sh
+
+set -o errexit
+set -o pipefail
+
+readonly THISPATH="$(dirname "$0")"
+readonly TMPDIR="${THISPATH}/tmp"
+readonly MAX_INTRINSICS_DIFFERENCE_PX="${MAX_INTRINSICS_DIFFERENCE_PX:-0.1}"
+readonly MAX_DISTORTION_DIFFERENCE="${MAX_DISTORTION_DIFFERENCE:-0.001}"
+readonly MAX_BOARD_CORNER_DIFFERENCE="${MAX_BOARD_CORNER_DIFFERENCE:-0.05}"
+mkdir -p "${TMPDIR}/"
+
+"${THISPATH}/benchmark.sh" "$@" >/dev/null
+cp "${TMPDIR}/benchmarkCamParams.xml" "${TMPDIR}/compare_ro.xml"
+cp "${TMPDIR}/benchmark.log" "${TMPDIR}/compare_ro.log"
+"${THISPATH}/benchmark.sh" --sparse_ro "$@" >/dev/null
+cp "${TMPDIR}/benchmarkCamParams.xml" "${TMPDIR}/compare_sparse_ro.xml"
+cp "${TMPDIR}/benchmark.log" "${TMPDIR}/compare_sparse_ro.log"
+
+python3 - "${TMPDIR}" <<EOP
+import json
+import re
+import sys
+import xml.etree.ElementTree as ElementTree
+
+tmpdir = sys.argv[1]
+number = r"-?\d+(?:\.\d*)?(?:[eE][-+]?\d+)?"
+
+
+def read_matrix(root, name):
+    return [float(n) for n in re.findall(number, root.find(name).find("data").text)]
+
+
+def load(name):
+    root = ElementTree.parse("{}/compare_{}.xml".format(tmpdir, name)).getroot()
+    k = read_matrix(root, "camera_matrix")
+    with open("{}/compare_{}.log".format(tmpdir, name)) as f:
+        lines = f.read().splitlines()
+    start = lines.index("New board corners: ") + 1
+    corners = [[float(n) for n in re.findall(number, line)] for line in lines[start : start + 4]]
+    return {
+        "intrinsics": {"fx": k[0], "fy": k[4], "cx": k[2], "cy": k[5]},
+        "distortion": read_matrix(root, "distortion_coefficients"),
+        "board_corners": corners,
+    }
+
+
+ro, sparse = load("ro"), load("sparse_ro")
+differences = {
+    "intrinsics_px": max(abs(ro["intrinsics"][name] - sparse["intrinsics"][name]) for name in ro["intrinsics"]),
+    "distortion": max(abs(a - b) for a, b in zip(ro["distortion"], sparse["distortion"])),
+    "board_corners": max(
+        abs(a - b) for corner, other in zip(ro["board_corners"], sparse["board_corners"]) for a, b in zip(corner, other)
+    ),
+}
+limits = {
+    "intrinsics_px": ${MAX_INTRINSICS_DIFFERENCE_PX},
+    "distortion": ${MAX_DISTORTION_DIFFERENCE},
+    "board_corners": ${MAX_BOARD_CORNER_DIFFERENCE},
+}
+print(json.dumps({"calibrateCameraRO": ro, "sparse_ro": sparse, "max_difference": differences}, indent=2))
+failed = [name for name, limit in limits.items() if differences[name] > limit]
+for name in failed:
+    print("FAIL: sparse_ro differs from calibrateCameraRO in " + name)
+sys.exit(1 if failed else 0)
+EOP
+echo "PASS"
@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+
+# Calibrate from the rendered OpenScad frames as if they were a video, without
+# a preview window, and check that enough frames get captured.
+# Exits with an error if fewer than MIN_CAPTURED (default 4) frames are kept.
+#
+# Extra arguments are passed on to calibrate_camera_charucoRO, like
+# ./video_capture_check.sh --online
+
+set -o errexit
+set -o pipefail
+
+readonly THISPATH="$(dirname "$0")"
+readonly TMPDIR="${THISPATH}/tmp"
+readonly MIN_CAPTURED="${MIN_CAPTURED:-4}"
+mkdir -p "${TMPDIR}/"
+
+pushd "${THISPATH}/.." >/dev/null
+./make
+popd >/dev/null
+
+pushd "${THISPATH}" >/dev/null
+../calibrate_camera_charucoRO --dictionary=16 \
+	--squares_x=16 \
+	--squares_y=11 \
+	--square_side_length=90.0 \
+	--marker_side_length=70.0 \
+	--detector_params=../detector_params.yml \
+	--grid_width=1260.0 \
+	--video=frame%05d.png \
+	--auto_capture \
+	--no_preview \
+	"$@" \
+	tmp/videoCamParams.xml | tee tmp/video_capture_check.log
+popd >/dev/null
+
+readonly CAPTURED="$(grep -c "^Frame [0-9]* captured$" "${TMPDIR}/video_capture_check.log" || true)"
+echo "Captured ${CAPTURED} of $(ls "${THISPATH}"/frame*.png | wc -l) frames"
+if [ "${CAPTURED}" -lt "${MIN_CAPTURED}" ]; then
+	echo "FAIL: fewer than ${MIN_CAPTURED} frames captured"
+	exit 1
+fi
+echo "PASS"
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Header of the binary camera params file that
+ * calibrate_camera_charucoRO --binary_params writes.
+ *
+ * It holds the same values as the XML file, bit for bit, followed by an
+ * undistortion lookup table of lutRows x lutCols float pairs (x, y). Entry
+ * (row, col) is the undistorted, normalised image coordinate of pixel
+ * (col * lutStep, row * lutStep). maxLutError is the largest difference
+ * between interpolating the table and undistorting with the coefficients,
+ * found at points a quarter lutStep apart across the image. Between those
+ * points the error can be slightly larger.
+ *
+ * Everything is stored in the byte order of the machine that wrote it.
+ * Both the calibration host and the Raspberry Pi are little endian.
+ */
+struct BinaryCamParamsHeader {
+  static constexpr uint32_t currentVersion{1};
+
+  char magic[8]; // "HPMCAMP" and a terminating zero
+  uint32_t version;
+  uint32_t headerSize;
+  int32_t imageWidth;
+  int32_t imageHeight;
+  double cameraMatrix[9]; // Row-major
+  double distCoeffs[14];  // Zero padded after nDistCoeffs
+  uint32_t nDistCoeffs;
+  uint32_t lutStep;
+  uint32_t lutCols;
+  uint32_t lutRows;
+  double maxLutError;          // Pixels
+  double avgReprojectionError; // Pixels
+};
+static_assert(sizeof(BinaryCamParamsHeader) == 240,
+              "The binary camera params layout must not change silently");
+
+static constexpr char binaryCamParamsMagic[8]{'H', 'P', 'M', 'C',
+                                              'A', 'M', 'P', '\0'};
+
+/** Bilinear interpolation in the lookup table of undistorted coordinates.
+ * Pixels outside the image are clamped to its border.
+ */
+inline void interpolateUndistortion(float const *lut, int const lutCols,
+                                    int const lutRows, int const lutStep,
+                                    double const u, double const v, double &x,
+                                    double &y) {
+  double const gu = std::min(std::max(u / lutStep, 0.0), lutCols - 1.0);
+  double const gv = std::min(std::max(v / lutStep, 0.0), lutRows - 1.0);
+  int const c = std::min((int)gu, lutCols - 2);
+  int const r = std::min((int)gv, lutRows - 2);
+  double const a = gu - c, b = gv - r;
+  float const *p00 = lut + 2 * (r * lutCols + c);
+  float const *p01 = p00 + 2;
+  float const *p10 = p00 + 2 * lutCols;
+  float const *p11 = p10 + 2;
+  x = (1 - b) * ((1 - a) * p00[0] + a * p01[0]) +
+      b * ((1 - a) * p10[0] + a * p11[0]);
+  y = (1 - b) * ((1 - a) * p00[1] + a * p01[1]) +
+      b * ((1 - a) * p10[1] + a * p11[1]);
+}
+
+/** Read-only view of a binary camera params file, mapped into memory.
+ * Loading costs one mmap, no parsing, and the lookup table pages are only
+ * read from disk when they're first used.
+ */
+class BinaryCamParams {
+public:
+  BinaryCamParams() = default;
+  BinaryCamParams(BinaryCamParams const &) = delete;
+  BinaryCamParams &operator=(BinaryCamParams const &) = delete;
+  ~BinaryCamParams() { close(); }
+
+  /** Returns false if the file can't be read, isn't a binary camera
+   * params file of the current version, or its header doesn't match its size.
+   */
+  bool open(std::string const &filename) {
+    close();
+    int const fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        st.st_size >= (off_t)sizeof(BinaryCamParamsHeader)) {
+      size_ = (size_t)st.st_size;
+      void *const data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED)
+        data_ = data;
+    }
+    ::close(fd);
+    if (data_ == nullptr)
+      return false;
+
+    header_ = static_cast<BinaryCamParamsHeader const *>(data_);
+    if (!isValid(*header_, size_)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (data_ != nullptr)
+      munmap(data_, size_);
+    data_ = nullptr;
+    header_ = nullptr;
+    size_ = 0;
+  }
+
+  BinaryCamParamsHeader const &header() const { return *header_; }
+
+  /** Undistorted, normalised image coordinates of pixel (u, v) */
+  void undistort(double const u, double const v, double &x, double &y) const {
+    interpolateUndistortion(lut(), (int)header_->lutCols,
+                            (int)header_->lutRows, (int)header_->lutStep, u,
+                            v, x, y);
+  }
+
+private:
+  /** The table must have the size that the writer computes from the image
+   * size and lutStep, and fill the rest of the file exactly
+   */
+  static bool isValid(BinaryCamParamsHeader const &header, size_t const size) {
+    if (std::memcmp(header.magic, binaryCamParamsMagic, 8) != 0 ||
+        header.version != BinaryCamParamsHeader::currentVersion ||
+        header.headerSize != sizeof(BinaryCamParamsHeader) ||
+        header.nDistCoeffs > 14 || header.lutStep == 0 ||
+        header.lutStep > (uint32_t)INT32_MAX || header.imageWidth < 2 ||
+        header.imageHeight < 2)
+      return false;
+    int64_t const step{header.lutStep};
+    if (header.lutCols != (header.imageWidth - 2 + step) / step + 1 ||
+        header.lutRows != (header.imageHeight - 2 + step) / step + 1)
+      return false;
+    // Divide instead of multiplying, so a huge table can't overflow
+    size_t const entrySize{2 * sizeof(float)};
+    size_t const lutBytes{size - sizeof(BinaryCamParamsHeader)};
+    return lutBytes % entrySize == 0 &&
+           lutBytes / entrySize / header.lutRows == header.lutCols &&
+           lutBytes / entrySize % header.lutRows == 0;
+  }
+
+  float const *lut() const {
+    return reinterpret_cast<float const *>(
+        static_cast<char const *>(data_) + sizeof(BinaryCamParamsHeader));
+  }
+
+  void *data_{nullptr};
+  size_t size_{0};
+  BinaryCamParamsHeader const *header_{nullptr};
+};
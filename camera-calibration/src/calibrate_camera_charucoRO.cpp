@@ -36,12 +36,32 @@ or tort (including negligence or otherwise) arising in any way out of
 the use of this software, even if advised of the possibility of such damage.
 */
 
+#include "binary_cam_params.hpp"
+#include "fixed_board.hpp"
+#include "parallel_for_each.hpp"
+#include "sparse_ro_solver.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <ctime>
+#include <exception>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <opencv2/aruco/charuco.hpp>
 #include <opencv2/calib3d.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
+#include <sstream>
+#include <sys/resource.h>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -51,7 +71,7 @@ namespace {
 const char *about =
     "Calibration using a ChArUco board\n"
     "  To capture a frame for calibration, press 'c',\n"
-    "  If input comes from video, press any key for next frame\n"
+    "  or let auto_capture pick frames that add new corner positions or poses\n"
     "  To finish capturing, press 'ESC' key and calibration starts.\n";
 // clang-format off
 const char *keys =
@@ -80,14 +100,26 @@ const char *keys =
     "{@outfile                  |<none> | Output file with calibrated camera parameters }"
     "{images_list               |       | List of input images }"
     "{camera_id                 | 0     | Camera id }"
+    "{video                     |       | Video file, image sequence like frame%05d.png, or directory of images, to read instead of the camera }"
+    "{auto_capture              | false | Capture frames with all corners found, when they cover new parts of the image or show the board in a new pose }"
+    "{no_preview                | false | Don't show the camera preview. Requires auto_capture and video }"
+    "{jobs                      | 0     | Number of threads used for marker detection. 0 means one per CPU core }"
+    "{streaming                 | false | Keep only detected corners, and the grey image region around the board, in memory }"
+    "{detection_cache           |       | Cache detections in this file, and corner patches in the directory <file>_patches. Later runs only decode new or changed images }"
     "{detector_params           |       | File of marker detector parameters }"
     "{refind_strategy           | false | Apply refind strategy. Unsure if this works. }"
     "{zero_tangential           | false | Assume zero tangential distortion }"
     "{focal_length              |       | Use this focal length as initial guess (unit: pixels) }"
     "{principal_point_at_center | false | Fix the principal point at the center }"
+    "{sparse_ro                 | false | Solve the release-object step with the sparse solver. Much faster than calibrateCameraRO with many images }"
+    "{online                    | false | When capturing, re-calibrate after every captured frame, and show the reprojection error and the uncertainty of each camera parameter }"
     "{test                      | false | For an image sequence, show what got detected, don't calculate anything }"
     "{verbose                   | false | Print out how many aruco tags and corners that were detected for each image }"
-    "{show_detected_chessboard  | false | Show detected chessboard corners after calibration }";
+    "{show_detected_chessboard  | false | Show detected chessboard corners after calibration }"
+    "{profile                   |       | Write time spent in each stage, peak memory use and results to this JSON file }"
+    "{reference                 |       | Camera params file to compare the result with in the profile }"
+    "{binary_params             |       | Also write the camera params and an undistortion lookup table to this binary file, for hpm to mmap }"
+    "{binary_params_lut_step    | 16    | Pixels between the lookup table entries in binary_params }";
 }
 // clang-format on
 
@@ -188,16 +220,1203 @@ static bool saveCameraParams(const string &filename, Size imageSize, int flags,
   return true;
 }
 
+/** Write the camera params, and a table of undistorted coordinates for every
+ * lutStep pixels, in the layout BinaryCamParamsHeader describes.
+ * The table's interpolation error is measured every quarter lutStep across
+ * the image, so on the corners, edges and insides of every table cell,
+ * against undistortPoints() run to convergence. The largest error found is
+ * stored in the file.
+ */
+static bool saveBinaryCameraParams(string const &filename, Size imageSize,
+                                   Mat const &cameraMatrix,
+                                   Mat const &distCoeffs, double totalAvgErr,
+                                   int const lutStep) {
+  CV_Assert(lutStep > 0);
+  BinaryCamParamsHeader header{};
+  copy(binaryCamParamsMagic, binaryCamParamsMagic + 8, header.magic);
+  header.version = BinaryCamParamsHeader::currentVersion;
+  header.headerSize = sizeof(BinaryCamParamsHeader);
+  header.imageWidth = imageSize.width;
+  header.imageHeight = imageSize.height;
+  for (int i{0}; i < 9; ++i)
+    header.cameraMatrix[i] = cameraMatrix.at<double>(i / 3, i % 3);
+  header.nDistCoeffs = (uint32_t)std::min<size_t>(distCoeffs.total(), 14);
+  for (uint32_t i{0}; i < header.nDistCoeffs; ++i)
+    header.distCoeffs[i] = distCoeffs.at<double>(i);
+  header.avgReprojectionError = totalAvgErr;
+
+  // Enough entries that the last row and column reach the image border
+  int const lutCols = (imageSize.width - 2 + lutStep) / lutStep + 1;
+  int const lutRows = (imageSize.height - 2 + lutStep) / lutStep + 1;
+  header.lutStep = lutStep;
+  header.lutCols = lutCols;
+  header.lutRows = lutRows;
+
+  TermCriteria const converged(TermCriteria::COUNT + TermCriteria::EPS, 100,
+                               1e-12);
+  vector<Point2f> nodes, samples;
+  for (int r{0}; r < lutRows; ++r)
+    for (int c{0}; c < lutCols; ++c)
+      nodes.emplace_back(float(c * lutStep), float(r * lutStep));
+  double const sampleStep{lutStep / 4.0};
+  for (double v{0}; v <= imageSize.height - 1; v += sampleStep)
+    for (double u{0}; u <= imageSize.width - 1; u += sampleStep)
+      samples.emplace_back(float(u), float(v));
+  vector<Point2f> lut, exact;
+  undistortPoints(nodes, lut, cameraMatrix, distCoeffs, noArray(), noArray(),
+                  converged);
+  undistortPoints(samples, exact, cameraMatrix, distCoeffs, noArray(),
+                  noArray(), converged);
+  float const *lutData = reinterpret_cast<float const *>(lut.data());
+  for (size_t i{0}; i < samples.size(); ++i) {
+    double x, y;
+    interpolateUndistortion(lutData, lutCols, lutRows, lutStep, samples[i].x,
+                            samples[i].y, x, y);
+    header.maxLutError = std::max(
+        header.maxLutError,
+        std::max(std::abs(x - exact[i].x) * header.cameraMatrix[0],
+                 std::abs(y - exact[i].y) * header.cameraMatrix[4]));
+  }
+
+  ofstream out(filename, ios::binary);
+  out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+  out.write(reinterpret_cast<char const *>(lutData),
+            sizeof(float) * 2 * lut.size());
+  if (!out)
+    return false;
+  cout << "Binary params lookup table is " << lutCols << "x" << lutRows
+       << ", max interpolation error " << header.maxLutError << " px" << endl;
+  return true;
+}
+
+/** Grey squares of an image around the chessboard corners that
+ * interpolateCornersCharuco() refines when it's given camera parameters.
+ * Patch i is rows [i * side, (i + 1) * side) of pixels, and its top left
+ * corner is at origins[i] in the image. Parts outside the image are zero.
+ */
+struct CornerPatches {
+  // interpolateCornersCharuco() caps its cornerSubPix() windows at 10 pixels.
+  // cornerSubPix() reads 2 pixels beyond the window around each step, and
+  // drops corners that moved further than the window, so a refined corner has
+  // looked at pixels within 3 * 10 + 2 of itself.
+  static constexpr int reach{32};
+  // How far a refined corner may be from the middle of its patch
+  static constexpr int slack{3};
+  static constexpr int radius{reach + slack};
+  static constexpr int side{2 * radius + 1};
+  vector<int> ids; // Ascending
+  vector<Point> origins;
+  Mat pixels;
+};
+
+/** Detection results for one calibration frame
+ */
+struct FrameDetection {
+  string name;
+  string contentHash;
+  Mat image;
+  Size imageSize;
+  vector<vector<Point2f>> corners;
+  vector<int> ids;
+  Mat charucoCorners;
+  Mat charucoIds;
+  // Interpolated using camera parameters. Only filled in from the cache
+  Mat calibratedCharucoCorners;
+  Mat calibratedCharucoIds;
+  // In streaming mode, what interpolateCornersCharuco() needs of the image
+  CornerPatches patches;
+};
+
+/** Accumulated wall time per calibration stage.
+ * Stages that run on the detection threads add up the time of all threads,
+ * so each stage also keeps the elapsed time from its first start to its last
+ * finish.
+ */
+class StageProfile {
+public:
+  enum Stage {
+    Imread,
+    DetectMarkers,
+    RefineDetectedMarkers,
+    InterpolateCornersCharuco,
+    CalibrateCameraAruco,
+    CalibrateCameraRO,
+    nStages
+  };
+
+  /** Adds the time from construction to destruction to a stage.
+   * Does nothing if profile is nullptr.
+   */
+  class Timer {
+  public:
+    Timer(StageProfile *const profile, Stage const stage)
+        : profile_(profile), stage_(stage),
+          start_(chrono::steady_clock::now()) {}
+    ~Timer() {
+      if (profile_ != nullptr)
+        profile_->add(stage_, start_, chrono::steady_clock::now());
+    }
+    Timer(Timer const &) = delete;
+    Timer &operator=(Timer const &) = delete;
+
+  private:
+    StageProfile *const profile_;
+    Stage const stage_;
+    chrono::steady_clock::time_point const start_;
+  };
+
+  void add(Stage const stage, chrono::steady_clock::time_point const start,
+           chrono::steady_clock::time_point const finish) {
+    nanoseconds_[stage] +=
+        chrono::duration_cast<chrono::nanoseconds>(finish - start).count();
+    ++calls_[stage];
+    lock_guard<mutex> const lock(spanMutex_);
+    if (firstStart_[stage] == chrono::steady_clock::time_point{} ||
+        start < firstStart_[stage])
+      firstStart_[stage] = start;
+    lastFinish_[stage] = std::max(lastFinish_[stage], finish);
+  }
+
+  /** Named results, like reprojection errors, to include in the JSON
+   */
+  void set(string const &name, double const value) { results_[name] = value; }
+
+  bool writeJson(string const &filename) const {
+    ofstream out(filename);
+    if (!out)
+      return false;
+    static char const *const names[nStages] = {
+        "imread",
+        "detectMarkers",
+        "refineDetectedMarkers",
+        "interpolateCornersCharuco",
+        "calibrateCameraAruco",
+        "calibrateCameraRO"};
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+
+    out << setprecision(9) << "{\n";
+    out << "  \"wall_time_s\": "
+        << chrono::duration<double>(chrono::steady_clock::now() - start_)
+               .count()
+        << ",\n";
+    out << "  \"peak_rss_kb\": " << usage.ru_maxrss << ",\n";
+    out << "  \"stages\": {\n";
+    for (int stage{0}; stage < nStages; ++stage) {
+      double const elapsed =
+          calls_[stage] == 0
+              ? 0.0
+              : chrono::duration<double>(lastFinish_[stage] -
+                                         firstStart_[stage])
+                    .count();
+      out << "    \"" << names[stage] << "\": {\"calls\": " << calls_[stage]
+          << ", \"time_s\": " << (double)nanoseconds_[stage] * 1e-9
+          << ", \"elapsed_s\": " << elapsed << "}"
+          << (stage + 1 < nStages ? ",\n" : "\n");
+    }
+    out << "  },\n";
+    out << "  \"results\": {";
+    char const *separator = "\n";
+    for (auto const &result : results_) {
+      out << separator << "    \"" << result.first << "\": " << result.second;
+      separator = ",\n";
+    }
+    out << "\n  }\n}\n";
+    return (bool)out;
+  }
+
+private:
+  chrono::steady_clock::time_point const start_{chrono::steady_clock::now()};
+  array<atomic<long long>, nStages> nanoseconds_{};
+  array<atomic<long long>, nStages> calls_{};
+  mutex spanMutex_;
+  array<chrono::steady_clock::time_point, nStages> firstStart_{};
+  array<chrono::steady_clock::time_point, nStages> lastFinish_{};
+  map<string, double> results_;
+};
+
+/** Differences between our result and a known good calibration
+ */
+static bool compareWithReference(string const &filename,
+                                 Mat const &cameraMatrix, Mat const &distCoeffs,
+                                 StageProfile &profile) {
+  FileStorage fs(filename, FileStorage::READ);
+  if (!fs.isOpened())
+    return false;
+  Mat refCameraMatrix;
+  Mat refDistCoeffs;
+  fs["camera_matrix"] >> refCameraMatrix;
+  fs["distortion_coefficients"] >> refDistCoeffs;
+  if (refCameraMatrix.empty() || refDistCoeffs.empty())
+    return false;
+
+  auto const diff = [&](int const r, int const c) {
+    return std::abs(cameraMatrix.at<double>(r, c) -
+                    refCameraMatrix.at<double>(r, c));
+  };
+  profile.set("focal_length_error_px", std::max(diff(0, 0), diff(1, 1)));
+  profile.set("principal_point_error_px", std::max(diff(0, 2), diff(1, 2)));
+  Mat refDist;
+  refDistCoeffs.reshape(1, 1).convertTo(refDist, CV_64F);
+  Mat dist;
+  distCoeffs.reshape(1, 1).convertTo(dist, CV_64F);
+  double maxDistortionError{0.0};
+  for (int i{0}; i < std::min(dist.cols, refDist.cols); ++i) {
+    maxDistortionError = std::max(
+        maxDistortionError,
+        std::abs(dist.at<double>(0, i) - refDist.at<double>(0, i)));
+  }
+  profile.set("distortion_coefficient_error", maxDistortionError);
+  return true;
+}
+
+/** What detectCharuco needs besides the image
+ */
+struct DetectionSettings {
+  Ptr<aruco::Dictionary> dictionary;
+  Ptr<aruco::DetectorParameters> detectorParams;
+  Ptr<aruco::CharucoBoard> charucoboard;
+  bool refindStrategy{false};
+  StageProfile *profile{nullptr};
+};
+
+static FrameDetection withoutImage(FrameDetection frame) {
+  frame.image.release();
+  frame.patches.pixels.release();
+  return frame;
+}
+
+/** 64-bit FNV-1a. Enough to tell if a file or a setting changed
+ */
+static uint64_t fnv1a(void const *data, size_t const size,
+                      uint64_t hash = 14695981039346656037ULL) {
+  auto const *bytes = static_cast<unsigned char const *>(data);
+  for (size_t i{0}; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/** FileStorage has no 64-bit integers, so hashes are stored as hex strings
+ */
+static string toHex(uint64_t const hash) {
+  ostringstream out;
+  out << hex << setw(16) << setfill('0') << hash;
+  return out.str();
+}
+
+static vector<uchar> readFileBytes(string const &filename) {
+  ifstream file(filename, ios::binary);
+  return vector<uchar>(istreambuf_iterator<char>(file),
+                       istreambuf_iterator<char>());
+}
+
+/** Everything that can change what detectCharuco finds in an image
+ */
+static string detectionSettingsHash(DetectionSettings const &detection,
+                                    int const squaresX, int const squaresY,
+                                    float const squareLength,
+                                    float const markerLength,
+                                    int const dictionaryId) {
+  Ptr<aruco::DetectorParameters> const &params = detection.detectorParams;
+  ostringstream settings;
+  settings << setprecision(17) << params->adaptiveThreshWinSizeMin << ' '
+           << params->adaptiveThreshWinSizeMax << ' '
+           << params->adaptiveThreshWinSizeStep << ' '
+           << params->adaptiveThreshConstant << ' '
+           << params->minMarkerPerimeterRate << ' '
+           << params->maxMarkerPerimeterRate << ' '
+           << params->polygonalApproxAccuracyRate << ' '
+           << params->minCornerDistanceRate << ' '
+           << params->minDistanceToBorder << ' '
+           << params->minMarkerDistanceRate << ' '
+           << params->cornerRefinementMethod << ' '
+           << params->cornerRefinementWinSize << ' '
+           << params->cornerRefinementMaxIterations << ' '
+           << params->cornerRefinementMinAccuracy << ' '
+           << params->markerBorderBits << ' '
+           << params->perspectiveRemovePixelPerCell << ' '
+           << params->perspectiveRemoveIgnoredMarginPerCell << ' '
+           << params->maxErroneousBitsInBorderRate << ' '
+           << params->minOtsuStdDev << ' ' << params->errorCorrectionRate
+           << ' ' << squaresX << ' ' << squaresY << ' ' << squareLength << ' '
+           << markerLength << ' ' << dictionaryId << ' '
+           << detection.refindStrategy << ' ' << CornerPatches::radius;
+  string const str = settings.str();
+  return toHex(fnv1a(str.data(), str.size()));
+}
+
+static string cameraParamsHash(Mat const &cameraMatrix, Mat const &distCoeffs) {
+  Mat const k = cameraMatrix.clone(); // clone() makes them continuous
+  Mat const d = distCoeffs.clone();
+  return toHex(fnv1a(d.ptr(), d.total() * d.elemSize(),
+                     fnv1a(k.ptr(), k.total() * k.elemSize())));
+}
+
+/** The corner patches are too big for the YAML cache, so each image's patches
+ * go into a PNG file, named after the image content, in a directory next to
+ * the cache file
+ */
+static string cornerPatchesDirectory(string const &cacheFileName) {
+  size_t const dot = cacheFileName.rfind('.');
+  size_t const slash = cacheFileName.rfind('/');
+  bool const hasExtension =
+      dot != string::npos && (slash == string::npos || dot > slash);
+  return (hasExtension ? cacheFileName.substr(0, dot) : cacheFileName) +
+         "_patches";
+}
+
+static string cornerPatchesFileName(string const &cacheFileName,
+                                    string const &contentHash) {
+  return cornerPatchesDirectory(cacheFileName) + "/" + contentHash + ".png";
+}
+
+/** Detections from earlier runs, keyed on image file name
+ */
+struct DetectionCache {
+  string settingsHash;
+  // Camera parameters that the calibrated charuco corners were interpolated
+  // with
+  string cameraHash;
+  map<string, FrameDetection> frames;
+};
+
+/** Returns an empty cache if the file is missing, or if it was written with
+ * other detection settings
+ */
+static DetectionCache readDetectionCache(string const &filename,
+                                         string const &settingsHash) {
+  DetectionCache cache;
+  FileStorage fs(filename, FileStorage::READ);
+  if (!fs.isOpened() || (string)fs["settings_hash"] != settingsHash)
+    return cache;
+  cache.settingsHash = settingsHash;
+  fs["camera_hash"] >> cache.cameraHash;
+  FileNode const frames = fs["frames"];
+  for (auto it = frames.begin(); it != frames.end(); ++it) {
+    FileNode const node = *it;
+    FrameDetection frame;
+    node["file"] >> frame.name;
+    node["content_hash"] >> frame.contentHash;
+    node["image_width"] >> frame.imageSize.width;
+    node["image_height"] >> frame.imageSize.height;
+    Mat corners;
+    node["corners"] >> corners;
+    for (int i{0}; i < corners.rows; ++i) {
+      frame.corners.push_back({corners.at<Point2f>(i, 0),
+                               corners.at<Point2f>(i, 1),
+                               corners.at<Point2f>(i, 2),
+                               corners.at<Point2f>(i, 3)});
+    }
+    node["ids"] >> frame.ids;
+    node["charuco_corners"] >> frame.charucoCorners;
+    node["charuco_ids"] >> frame.charucoIds;
+    node["calibrated_charuco_corners"] >> frame.calibratedCharucoCorners;
+    node["calibrated_charuco_ids"] >> frame.calibratedCharucoIds;
+    node["patch_ids"] >> frame.patches.ids;
+    node["patch_origins"] >> frame.patches.origins;
+    cache.frames[frame.name] = frame;
+  }
+  return cache;
+}
+
+static bool writeDetectionCache(string const &filename,
+                                DetectionCache const &cache) {
+  FileStorage fs(filename, FileStorage::WRITE);
+  if (!fs.isOpened())
+    return false;
+  fs << "settings_hash" << cache.settingsHash;
+  fs << "camera_hash" << cache.cameraHash;
+  fs << "frames"
+     << "[";
+  for (auto const &entry : cache.frames) {
+    FrameDetection const &frame = entry.second;
+    fs << "{";
+    fs << "file" << frame.name;
+    fs << "content_hash" << frame.contentHash;
+    fs << "image_width" << frame.imageSize.width;
+    fs << "image_height" << frame.imageSize.height;
+    // Empty matrices are left out, and read back as empty
+    if (!frame.corners.empty()) {
+      Mat corners((int)frame.corners.size(), 4, CV_32FC2);
+      for (int i{0}; i < corners.rows; ++i)
+        for (int j{0}; j < 4; ++j)
+          corners.at<Point2f>(i, j) = frame.corners[i][j];
+      fs << "corners" << corners;
+    }
+    fs << "ids" << frame.ids;
+    if (!frame.charucoIds.empty()) {
+      fs << "charuco_corners" << frame.charucoCorners;
+      fs << "charuco_ids" << frame.charucoIds;
+    }
+    if (!frame.calibratedCharucoIds.empty()) {
+      fs << "calibrated_charuco_corners" << frame.calibratedCharucoCorners;
+      fs << "calibrated_charuco_ids" << frame.calibratedCharucoIds;
+    }
+    if (!frame.patches.ids.empty()) {
+      fs << "patch_ids" << frame.patches.ids;
+      fs << "patch_origins" << frame.patches.origins;
+    }
+    fs << "}";
+  }
+  fs << "]";
+  return true;
+}
+
+/** Detect aruco markers, and interpolate charuco corners from them
+ */
+static void detectCharuco(FrameDetection &frame,
+                          DetectionSettings const &settings) {
+  frame.imageSize = frame.image.size();
+  // All the aruco functions below convert to grey scale internally.
+  // Convert only once.
+  Mat grey;
+  if (frame.image.type() == CV_8UC3)
+    cvtColor(frame.image, grey, COLOR_BGR2GRAY);
+  else
+    grey = frame.image;
+
+  vector<vector<Point2f>> rejected;
+  // detect markers
+  {
+    StageProfile::Timer const timer(settings.profile,
+                                    StageProfile::DetectMarkers);
+    aruco::detectMarkers(grey, settings.dictionary, frame.corners, frame.ids,
+                         settings.detectorParams, rejected);
+  }
+  // refind strategy to detect more markers
+  if (settings.refindStrategy) {
+    StageProfile::Timer const timer(settings.profile,
+                                    StageProfile::RefineDetectedMarkers);
+    aruco::refineDetectedMarkers(
+        grey, settings.charucoboard.staticCast<aruco::Board>(), frame.corners,
+        frame.ids, rejected);
+  }
+  // interpolate charuco corners
+  if (frame.ids.size() > 0) {
+    StageProfile::Timer const timer(settings.profile,
+                                    StageProfile::InterpolateCornersCharuco);
+    aruco::interpolateCornersCharuco(frame.corners, frame.ids, grey,
+                                     settings.charucoboard,
+                                     frame.charucoCorners, frame.charucoIds);
+  }
+}
+
+/** Read an image the way the aruco functions would see it.
+ * IMREAD_GRAYSCALE would let the decoder do its own, slightly different,
+ * grey conversion, so convert with cvtColor like aruco does.
+ */
+static Mat imreadGrey(string const &filename) {
+  Mat grey;
+  cvtColor(imread(filename, 1), grey, COLOR_BGR2GRAY);
+  return grey;
+}
+
+/** Cut the corner patches out of a BGR or grey image. The patches are centred
+ * on the charuco corners found without camera parameters, and on where a
+ * neighbouring detected marker puts the corners that weren't found.
+ */
+static CornerPatches cutCornerPatches(Mat const &image,
+                                      FrameDetection const &frame,
+                                      aruco::CharucoBoard const &board) {
+  map<int, Point2f> estimates;
+  for (int i{0}; i < (int)frame.charucoIds.total(); ++i)
+    estimates[frame.charucoIds.at<int>(i)] =
+        frame.charucoCorners.at<Point2f>(i);
+  for (int id{0}; id < (int)board.chessboardCorners.size(); ++id) {
+    if (estimates.count(id) > 0)
+      continue;
+    for (int const m : board.nearestMarkerIdx[id]) {
+      auto const found = find(frame.ids.begin(), frame.ids.end(), board.ids[m]);
+      if (found == frame.ids.end())
+        continue;
+      vector<Point2f> square, corner, projected;
+      for (auto const &point : board.objPoints[m])
+        square.emplace_back(point.x, point.y);
+      corner.emplace_back(board.chessboardCorners[id].x,
+                          board.chessboardCorners[id].y);
+      perspectiveTransform(
+          corner, projected,
+          getPerspectiveTransform(square,
+                                  frame.corners[found - frame.ids.begin()]));
+      estimates[id] = projected[0];
+      break;
+    }
+  }
+
+  int const side{CornerPatches::side};
+  Rect const imageRect(Point(0, 0), image.size());
+  CornerPatches patches;
+  patches.pixels = Mat::zeros(side * (int)estimates.size(), side, CV_8U);
+  for (auto const &estimate : estimates) {
+    Point const origin(cvRound(estimate.second.x) - CornerPatches::radius,
+                       cvRound(estimate.second.y) - CornerPatches::radius);
+    Rect const inImage = Rect(origin, Size(side, side)) & imageRect;
+    if (inImage.empty())
+      continue;
+    Point const row(0, side * (int)patches.ids.size());
+    Mat block =
+        patches.pixels(Rect(inImage.tl() - origin + row, inImage.size()));
+    // The same grey conversion as aruco does
+    if (image.channels() == 3)
+      cvtColor(image(inImage), block, COLOR_BGR2GRAY);
+    else
+      image(inImage).copyTo(block);
+    patches.ids.push_back(estimate.first);
+    patches.origins.push_back(origin);
+  }
+  patches.pixels = patches.pixels.rowRange(0, side * (int)patches.ids.size());
+  return patches;
+}
+
+/** interpolateCornersCharuco() with camera parameters, on an image that has
+ * nothing but the corner patches. The corners are the same as on the whole
+ * image, except for corners further than CornerPatches::slack from the middle
+ * of their patch, which may have looked outside it. Those are left out, and
+ * their number returned.
+ */
+static int interpolateInCornerPatches(FrameDetection const &frame,
+                                      CornerPatches const &patches,
+                                      Ptr<aruco::CharucoBoard> const &board,
+                                      Mat const &cameraMatrix,
+                                      Mat const &distCoeffs,
+                                      Mat &charucoCorners, Mat &charucoIds) {
+  int const side{CornerPatches::side};
+  Rect const imageRect(Point(0, 0), frame.imageSize);
+  Mat grey = Mat::zeros(frame.imageSize, CV_8U);
+  for (int i{0}; i < (int)patches.ids.size(); ++i) {
+    Rect const inImage = Rect(patches.origins[i], Size(side, side)) & imageRect;
+    Point const row(0, side * i);
+    Mat target = grey(inImage);
+    patches.pixels(Rect(inImage.tl() - patches.origins[i] + row,
+                        inImage.size()))
+        .copyTo(target);
+  }
+  Mat corners, ids;
+  aruco::interpolateCornersCharuco(frame.corners, frame.ids, grey, board,
+                                   corners, ids, cameraMatrix, distCoeffs);
+
+  vector<Point2f> keptCorners;
+  vector<int> keptIds;
+  int nLeftOut{0};
+  for (int i{0}; i < (int)ids.total(); ++i) {
+    int const id = ids.at<int>(i);
+    Point2f const corner = corners.at<Point2f>(i);
+    auto const patch = lower_bound(patches.ids.begin(), patches.ids.end(), id);
+    bool covered = patch != patches.ids.end() && *patch == id;
+    if (covered) {
+      Point const origin = patches.origins[patch - patches.ids.begin()];
+      covered = std::abs(corner.x - (origin.x + CornerPatches::radius)) <=
+                    CornerPatches::slack &&
+                std::abs(corner.y - (origin.y + CornerPatches::radius)) <=
+                    CornerPatches::slack;
+    }
+    if (covered) {
+      keptCorners.push_back(corner);
+      keptIds.push_back(id);
+    } else {
+      ++nLeftOut;
+    }
+  }
+  Mat(keptCorners).copyTo(charucoCorners);
+  Mat(keptIds).copyTo(charucoIds);
+  return nLeftOut;
+}
+
+/** Single slot hand-over between two threads.
+ * A lossy mailbox replaces an item that nobody took yet, so the reader always
+ * gets the newest one. A lossless mailbox makes put() wait instead.
+ */
+template <typename T> class Mailbox {
+public:
+  explicit Mailbox(bool const lossless) : lossless_(lossless) {}
+
+  void put(T item) {
+    unique_lock<mutex> lock(mutex_);
+    if (lossless_)
+      taken_.wait(lock, [this] { return !full_ || closed_; });
+    if (closed_)
+      return;
+    if (full_)
+      ++dropped_;
+    item_ = std::move(item);
+    full_ = true;
+    filled_.notify_one();
+  }
+
+  /** Returns false on timeout, and when closed and empty
+   */
+  bool take(T &item, chrono::milliseconds const timeout) {
+    unique_lock<mutex> lock(mutex_);
+    if (!filled_.wait_for(lock, timeout, [this] { return full_ || closed_; }) ||
+        !full_)
+      return false;
+    item = std::move(item_);
+    full_ = false;
+    taken_.notify_one();
+    return true;
+  }
+
+  void close() {
+    lock_guard<mutex> const lock(mutex_);
+    closed_ = true;
+    filled_.notify_all();
+    taken_.notify_all();
+  }
+
+  bool finished() {
+    lock_guard<mutex> const lock(mutex_);
+    return closed_ && !full_;
+  }
+
+  int dropped() {
+    lock_guard<mutex> const lock(mutex_);
+    return dropped_;
+  }
+
+private:
+  bool const lossless_;
+  mutex mutex_;
+  condition_variable filled_;
+  condition_variable taken_;
+  T item_;
+  bool full_{false};
+  bool closed_{false};
+  int dropped_{0};
+};
+
+/** Frames from a camera, a video file, an image sequence like frame%05d.png,
+ * or all images in a directory
+ */
+class FrameSource {
+public:
+  bool open(string const &video, int const camId) {
+    if (video.empty()) {
+      live_ = true;
+      return capture_.open(camId);
+    }
+    if (utils::fs::isDirectory(video)) {
+      glob(video, files_, false);
+      sort(files_.begin(), files_.end());
+      return !files_.empty();
+    }
+    return capture_.open(video);
+  }
+
+  /** A live camera keeps producing frames whether we read them or not
+   */
+  bool isLive() const { return live_; }
+
+  bool read(Mat &image) {
+    if (!files_.empty()) {
+      // Skip files that aren't images
+      while (nextFile_ < files_.size()) {
+        image = imread(files_[nextFile_++], 1);
+        if (!image.empty())
+          return true;
+      }
+      return false;
+    }
+    return capture_.grab() && capture_.retrieve(image);
+  }
+
+private:
+  VideoCapture capture_;
+  vector<String> files_;
+  size_t nextFile_{0};
+  bool live_{false};
+};
+
+/** Where the board is in an image, roughly
+ */
+struct BoardPose {
+  double angle;    // In-plane rotation (radians)
+  double logScale; // Log of pixels per board unit
+  double tiltX;    // Relative perspective foreshortening across the board
+  double tiltY;
+};
+
+/** Decides if a frame adds anything to the calibration.
+ * A frame is new if its corners cover image cells that no earlier keyframe
+ * covered, or if it shows the board in a pose unlike all earlier keyframes.
+ */
+class KeyframeSelector {
+public:
+  explicit KeyframeSelector(Ptr<aruco::CharucoBoard> const &board)
+      : board_(board) {}
+
+  /** Returns true, and remembers the frame, if it should be used
+   */
+  bool accept(FrameDetection const &frame) {
+    // calibrateCameraCharucoRO needs every corner in every frame
+    if (frame.charucoIds.total() < board_->chessboardCorners.size())
+      return false;
+
+    if (coverage_.empty())
+      coverage_ = Mat::zeros(gridRows, gridCols, CV_8U);
+    Mat covered = coverage_.clone();
+    int newCells{0};
+    for (int i{0}; i < (int)frame.charucoCorners.total(); ++i) {
+      Point2f const corner = frame.charucoCorners.at<Point2f>(i);
+      int const col = std::min(
+          gridCols - 1,
+          std::max(0, (int)(corner.x * gridCols / frame.imageSize.width)));
+      int const row = std::min(
+          gridRows - 1,
+          std::max(0, (int)(corner.y * gridRows / frame.imageSize.height)));
+      uchar &cell = covered.at<uchar>(row, col);
+      if (cell == 0) {
+        cell = 1;
+        ++newCells;
+      }
+    }
+
+    BoardPose const pose = boardPose(frame);
+    bool newPose{true};
+    for (auto const &seen : poses_) {
+      if (poseDistance(pose, seen) < 1.0) {
+        newPose = false;
+        break;
+      }
+    }
+
+    if (newCells < minNewCells && !newPose)
+      return false;
+    coverage_ = covered;
+    poses_.push_back(pose);
+    return true;
+  }
+
+private:
+  static constexpr int gridCols{16};
+  static constexpr int gridRows{12};
+  static constexpr int minNewCells{4};
+  // Poses closer than this in every respect count as the same pose
+  static constexpr double angleStep{15.0 * CV_PI / 180.0};
+  static constexpr double logScaleStep{0.2};
+  static constexpr double tiltStep{0.1};
+
+  /** Derived from the board-to-image homography, at the board's center
+   */
+  BoardPose boardPose(FrameDetection const &frame) const {
+    vector<Point2f> boardPoints;
+    vector<Point2f> imagePoints;
+    Point2d center{0.0, 0.0};
+    Point2d extent{0.0, 0.0};
+    for (int i{0}; i < (int)frame.charucoIds.total(); ++i) {
+      Point3f const p = board_->chessboardCorners[frame.charucoIds.at<int>(i)];
+      boardPoints.emplace_back(p.x, p.y);
+      imagePoints.push_back(frame.charucoCorners.at<Point2f>(i));
+      center.x += p.x;
+      center.y += p.y;
+      extent.x = std::max(extent.x, (double)p.x);
+      extent.y = std::max(extent.y, (double)p.y);
+    }
+    center.x /= (double)boardPoints.size();
+    center.y /= (double)boardPoints.size();
+
+    Mat const H = findHomography(boardPoints, imagePoints);
+    auto const h = [&H](int const r, int const c) {
+      return H.at<double>(r, c);
+    };
+    double const w = h(2, 0) * center.x + h(2, 1) * center.y + h(2, 2);
+    double const u = (h(0, 0) * center.x + h(0, 1) * center.y + h(0, 2)) / w;
+    double const v = (h(1, 0) * center.x + h(1, 1) * center.y + h(1, 2)) / w;
+    // Jacobian of the homography
+    double const j00 = (h(0, 0) - u * h(2, 0)) / w;
+    double const j01 = (h(0, 1) - u * h(2, 1)) / w;
+    double const j10 = (h(1, 0) - v * h(2, 0)) / w;
+    double const j11 = (h(1, 1) - v * h(2, 1)) / w;
+
+    BoardPose pose;
+    pose.angle = atan2(j10, j00);
+    pose.logScale = 0.5 * log(std::abs(j00 * j11 - j01 * j10));
+    pose.tiltX = h(2, 0) * extent.x / w;
+    pose.tiltY = h(2, 1) * extent.y / w;
+    return pose;
+  }
+
+  static double poseDistance(BoardPose const &a, BoardPose const &b) {
+    double const angleDiff = remainder(a.angle - b.angle, 2.0 * CV_PI);
+    return std::max({std::abs(angleDiff) / angleStep,
+                     std::abs(a.logScale - b.logScale) / logScaleStep,
+                     std::abs(a.tiltX - b.tiltX) / tiltStep,
+                     std::abs(a.tiltY - b.tiltY) / tiltStep});
+  }
+
+  Ptr<aruco::CharucoBoard> const board_;
+  Mat coverage_;
+  vector<BoardPose> poses_;
+};
+
+/** Re-calibrates as frames get captured, so that capturing can stop as soon
+ * as the camera parameters have converged.
+ * The board is taken to be exactly as specified, so only the intrinsics and
+ * the frame poses are solved for. Each solve starts from the previous
+ * solution, and the new frame's pose starts from solvePnP with the current
+ * intrinsics, but every solve re-optimises the poses of all frames, so it
+ * takes longer the more frames there are. The first estimate comes from
+ * initCameraMatrix2D, once minFrames frames are captured.
+ */
+class OnlineCalibration {
+public:
+  OnlineCalibration(Ptr<aruco::CharucoBoard> const &board,
+                    Mat const &cameraMatrix, int const flags, int const nJobs)
+      : board_(board), cameraMatrix_(cameraMatrix.clone()), flags_(flags),
+        nJobs_(nJobs) {}
+
+  /** Returns true if solve() has something new to solve for
+   */
+  bool add(FrameDetection const &frame) {
+    if ((int)frame.charucoIds.total() < minCorners)
+      return false;
+    vector<int> ids;
+    vector<Point2f> imagePoints;
+    vector<Point3f> objectPoints;
+    frame.charucoIds.copyTo(ids);
+    frame.charucoCorners.copyTo(imagePoints);
+    for (int const id : ids)
+      objectPoints.push_back(board_->chessboardCorners[id]);
+
+    if (!solver_) {
+      allIds_.push_back(ids);
+      allImagePoints_.push_back(imagePoints);
+      allObjectPoints_.push_back(objectPoints);
+      if ((int)allIds_.size() < minFrames)
+        return false;
+      start(frame.imageSize);
+    } else {
+      Mat cameraMatrix, distCoeffs;
+      currentEstimate(cameraMatrix, distCoeffs);
+      Vec3d rvec, tvec;
+      solvePnP(objectPoints, imagePoints, cameraMatrix, distCoeffs, rvec,
+               tvec);
+      solver_->addFrame(ids, imagePoints, rvec, tvec);
+    }
+    return true;
+  }
+
+  /** Levenberg-Marquardt over all frames added so far
+   */
+  void solve() { rms_ = solver_->solve(); }
+
+  /** Every parameter with its standard deviation
+   */
+  string summary() const {
+    static char const *const names[9]{"fx", "fy", "cx", "cy", "k1",
+                                      "k2", "p1", "p2", "k3"};
+    ostringstream out;
+    out << "Online calibration of " << solver_->frames() << " frames: rms "
+        << setprecision(3) << rms_ << " px";
+    for (int k{0}; k < 9; ++k)
+      out << ", " << names[k] << " " << setprecision(6)
+          << solver_->intrinsics()[k] << " +- " << setprecision(2)
+          << solver_->intrinsicStdDevs()[k];
+    return out.str();
+  }
+
+  /** Short enough for the preview window
+   */
+  string briefSummary() const {
+    auto const &sd = solver_->intrinsicStdDevs();
+    ostringstream out;
+    out << fixed << setprecision(2) << "rms " << rms_ << " px, std dev fx "
+        << sd[0] << ", fy " << sd[1] << ", cx " << sd[2] << ", cy " << sd[3];
+    return out.str();
+  }
+
+private:
+  static constexpr int minFrames{3};
+  static constexpr int minCorners{8};
+
+  void start(Size const imageSize) {
+    Mat cameraMatrix =
+        initCameraMatrix2D(allObjectPoints_, allImagePoints_, imageSize);
+    if (flags_ & CALIB_USE_INTRINSIC_GUESS) {
+      cameraMatrix.at<double>(0, 0) = cameraMatrix_.at<double>(0, 0);
+      cameraMatrix.at<double>(1, 1) = cameraMatrix_.at<double>(1, 1);
+    }
+    if (flags_ & (CALIB_USE_INTRINSIC_GUESS | CALIB_FIX_PRINCIPAL_POINT)) {
+      cameraMatrix.at<double>(0, 2) = 0.5 * (imageSize.width - 1);
+      cameraMatrix.at<double>(1, 2) = 0.5 * (imageSize.height - 1);
+    }
+    SparseROSolver::Intrinsics const intrinsics{
+        cameraMatrix.at<double>(0, 0), cameraMatrix.at<double>(1, 1),
+        cameraMatrix.at<double>(0, 2), cameraMatrix.at<double>(1, 2)};
+    vector<int> allCoordinates(3 * board_->chessboardCorners.size());
+    for (size_t k{0}; k < allCoordinates.size(); ++k)
+      allCoordinates[k] = (int)k;
+    solver_.reset(new SparseROSolver(intrinsics, board_->chessboardCorners,
+                                     allCoordinates, flags_, nJobs_));
+    Mat const noDistortion = Mat::zeros(1, 5, CV_64F);
+    for (size_t i{0}; i < allIds_.size(); ++i) {
+      Vec3d rvec, tvec;
+      solvePnP(allObjectPoints_[i], allImagePoints_[i], cameraMatrix,
+               noDistortion, rvec, tvec);
+      solver_->addFrame(allIds_[i], allImagePoints_[i], rvec, tvec);
+    }
+    allIds_.clear();
+    allImagePoints_.clear();
+    allObjectPoints_.clear();
+  }
+
+  void currentEstimate(Mat &cameraMatrix, Mat &distCoeffs) const {
+    auto const &a = solver_->intrinsics();
+    cameraMatrix = Mat::eye(3, 3, CV_64F);
+    cameraMatrix.at<double>(0, 0) = a[0];
+    cameraMatrix.at<double>(1, 1) = a[1];
+    cameraMatrix.at<double>(0, 2) = a[2];
+    cameraMatrix.at<double>(1, 2) = a[3];
+    distCoeffs = Mat(1, 5, CV_64F);
+    for (int k{0}; k < 5; ++k)
+      distCoeffs.at<double>(k) = a[4 + k];
+  }
+
+  Ptr<aruco::CharucoBoard> const board_;
+  Mat const cameraMatrix_;
+  int const flags_;
+  int const nJobs_;
+  // Frames captured before there are enough to start from
+  vector<vector<int>> allIds_;
+  vector<vector<Point2f>> allImagePoints_;
+  vector<vector<Point3f>> allObjectPoints_;
+  unique_ptr<SparseROSolver> solver_;
+  double rms_{0};
+};
+
+/** Grab, detect and show frames on separate threads.
+ * From a live camera, frames that the detector is too slow for are dropped,
+ * and the preview shows the newest frame with the newest detection drawn on
+ * it. From files, every frame is detected.
+ * Online calibration runs on a thread of its own too. Frames captured while it
+ * solves are all added to the next solve.
+ */
+static vector<FrameDetection> captureFrames(FrameSource &source,
+                                            DetectionSettings const &settings,
+                                            bool const autoCapture,
+                                            bool const showPreview,
+                                            bool const streaming,
+                                            OnlineCalibration *online) {
+  vector<FrameDetection> captured;
+  mutex capturedMutex;
+  string onlineStatus;
+  mutex onlineStatusMutex;
+  Mailbox<size_t> toCalibrate(false);
+  auto const keep = [&](FrameDetection frame) {
+    if (streaming) {
+      frame.patches =
+          cutCornerPatches(frame.image, frame, *settings.charucoboard);
+      frame.image.release();
+    }
+    lock_guard<mutex> const lock(capturedMutex);
+    captured.push_back(frame);
+    cout << "Frame " << captured.size() << " captured" << endl;
+    toCalibrate.put(captured.size());
+  };
+
+  atomic<bool> stop{false};
+  Mailbox<Mat> toDetect(!source.isLive());
+  Mailbox<Mat> toPreview(false);
+  Mailbox<FrameDetection> detected(false);
+
+  // Only says how many frames there are, so a lossy mailbox loses nothing
+  thread calibrator([&]() {
+    if (!online)
+      return;
+    size_t nAdded{0};
+    auto const catchUp = [&]() {
+      vector<FrameDetection> newFrames;
+      {
+        lock_guard<mutex> const lock(capturedMutex);
+        newFrames.assign(captured.begin() + nAdded, captured.end());
+        nAdded = captured.size();
+      }
+      bool updated{false};
+      for (auto const &frame : newFrames)
+        updated = online->add(frame) || updated;
+      if (!updated)
+        return;
+      online->solve();
+      cout << online->summary() << endl;
+      lock_guard<mutex> const statusLock(onlineStatusMutex);
+      onlineStatus = online->briefSummary();
+    };
+    size_t nCaptured;
+    while (!toCalibrate.finished())
+      if (toCalibrate.take(nCaptured, chrono::milliseconds(100)))
+        catchUp();
+    catchUp();
+  });
+
+  thread grabber([&]() {
+    while (!stop) {
+      Mat image;
+      if (!source.read(image))
+        break;
+      if (showPreview)
+        toPreview.put(image);
+      toDetect.put(image);
+    }
+    toDetect.close();
+    toPreview.close();
+  });
+
+  thread detector([&]() {
+    KeyframeSelector selector(settings.charucoboard);
+    while (!toDetect.finished()) {
+      FrameDetection frame;
+      if (!toDetect.take(frame.image, chrono::milliseconds(100)))
+        continue;
+      detectCharuco(frame, settings);
+      if (autoCapture && selector.accept(frame))
+        keep(frame);
+      if (showPreview)
+        detected.put(std::move(frame));
+    }
+    detected.close();
+  });
+
+  if (showPreview) {
+    Mat latestImage;
+    FrameDetection latest;
+    while (!toPreview.finished() || !detected.finished()) {
+      toPreview.take(latestImage, chrono::milliseconds(1));
+      detected.take(latest, chrono::milliseconds(1));
+      if (!latestImage.empty()) {
+        Mat imageCopy = latestImage.clone();
+        if (latest.ids.size() > 0)
+          aruco::drawDetectedMarkers(imageCopy, latest.corners);
+        if (latest.charucoCorners.total() > 0)
+          aruco::drawDetectedCornersCharuco(imageCopy, latest.charucoCorners,
+                                            latest.charucoIds);
+        putText(imageCopy,
+                autoCapture
+                    ? "Capturing automatically. 'ESC' to finish and calibrate"
+                    : "Press 'c' to add current frame. 'ESC' to finish and "
+                      "calibrate",
+                Point(10, 20), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(255, 0, 0),
+                2);
+        {
+          lock_guard<mutex> const statusLock(onlineStatusMutex);
+          if (!onlineStatus.empty())
+            putText(imageCopy, onlineStatus, Point(10, 40),
+                    FONT_HERSHEY_SIMPLEX, 0.5, Scalar(255, 0, 0), 2);
+        }
+        imshow("out", imageCopy);
+      }
+      char key = (char)waitKey(10);
+      if (key == 27)
+        break;
+      if (key == 'c' && latest.ids.size() > 0)
+        keep(latest);
+    }
+  }
+
+  if (!showPreview) {
+    // Nothing can stop capturing early, so read the source to its end. The
+    // grabber closes toDetect, and the detector still gets the last frame
+    grabber.join();
+  }
+  stop = true;
+  toDetect.close();
+  toPreview.close();
+  if (grabber.joinable())
+    grabber.join();
+  detector.join();
+  toCalibrate.close();
+  calibrator.join();
+  if (source.isLive()) {
+    cout << "Skipped " << toDetect.dropped()
+         << " frames that came in while detecting" << endl;
+  }
+  return captured;
+}
+
+/** Drop-in for calibrateCameraRO() that uses SparseROSolver.
+ * Unlike calibrateCameraRO() it never initialises the intrinsics itself, it
+ * always starts from cameraMatrix and distCoeffs, which come from the aruco
+ * calibration. Only the five coefficient distortion model is supported.
+ */
+static double calibrateCameraSparseRO(
+    InputArrayOfArrays _allObjPoints, InputArrayOfArrays _charucoCorners,
+    InputArrayOfArrays _charucoIds, int const iFix,
+    InputOutputArray _cameraMatrix, InputOutputArray _distCoeffs,
+    int const flags, int const nJobs, vector<Point3f> &newObjPoints) {
+  Mat const cameraMatrix = _cameraMatrix.getMat();
+  Mat const distCoeffs = _distCoeffs.getMat();
+  SparseROSolver::Intrinsics intrinsics{
+      cameraMatrix.at<double>(0, 0), cameraMatrix.at<double>(1, 1),
+      cameraMatrix.at<double>(0, 2), cameraMatrix.at<double>(1, 2)};
+  for (int k{0}; k < std::min(5, (int)distCoeffs.total()); ++k)
+    intrinsics[4 + k] = distCoeffs.at<double>(k);
+
+  // Every frame sees every corner, so observation j is board point j
+  vector<Point3f> boardPoints;
+  _allObjPoints.getMat(0).copyTo(boardPoints);
+  int const nCorners = (int)boardPoints.size();
+  // Same gauge as calibrateCameraRO(): all of the first corner and corner
+  // iFix, and z of the last corner
+  SparseROSolver solver(intrinsics, boardPoints,
+                        {0, 1, 2, 3 * iFix, 3 * iFix + 1, 3 * iFix + 2,
+                         3 * (nCorners - 1) + 2},
+                        flags, nJobs);
+  for (int i{0}; i < (int)_allObjPoints.total(); ++i) {
+    vector<Point2f> corners;
+    vector<int> ids;
+    _charucoCorners.getMat(i).copyTo(corners);
+    _charucoIds.getMat(i).copyTo(ids);
+    Vec3d rvec, tvec;
+    solvePnP(_allObjPoints.getMat(i), corners, cameraMatrix, distCoeffs, rvec,
+             tvec);
+    solver.addFrame(ids, corners, rvec, tvec);
+  }
+  double const rms = solver.solve();
+
+  auto const &a = solver.intrinsics();
+  Mat newCameraMatrix = Mat::eye(3, 3, CV_64F);
+  newCameraMatrix.at<double>(0, 0) = a[0];
+  newCameraMatrix.at<double>(1, 1) = a[1];
+  newCameraMatrix.at<double>(0, 2) = a[2];
+  newCameraMatrix.at<double>(1, 2) = a[3];
+  newCameraMatrix.copyTo(_cameraMatrix);
+  Mat newDistCoeffs(1, 5, CV_64F);
+  for (int k{0}; k < 5; ++k)
+    newDistCoeffs.at<double>(k) = a[4 + k];
+  newDistCoeffs.copyTo(_distCoeffs);
+  newObjPoints = solver.boardPoints();
+  cout << "Sparse RO solver converged after " << solver.iterations()
+       << " iterations" << endl;
+  return rms;
+}
+
 double calibrateCameraCharucoRO(InputArrayOfArrays _charucoCorners,
                                 InputArrayOfArrays _charucoIds,
                                 Ptr<aruco::CharucoBoard> const &_board,
                                 Size imageSize, InputOutputArray _cameraMatrix,
                                 InputOutputArray _distCoeffs, int const flags,
-                                int const iFix, float const grid_width) {
+                                int const iFix, float const grid_width,
+                                bool const sparse, int const nJobs) {
 
   CV_Assert(_charucoIds.total() > 0 &&
             (_charucoIds.total() == _charucoCorners.total()));
 
+#ifdef FIXED_BOARD
+  // Every frame has every corner in id order, so all frames share one stack
+  // array of object points, and the id mapping is only checked
+  ProductionBoard::ObjectPoints const boardPoints =
+      ProductionBoard::objectPoints(_board->getSquareLength(), iFix,
+                                    grid_width);
+  for (int i{0}; i < (int)_charucoIds.total(); ++i)
+    CV_Assert(ProductionBoard::hasAllCorners(_charucoIds.getMat(i)) &&
+              (int)_charucoCorners.getMat(i).total() ==
+                  ProductionBoard::nCorners);
+  vector<Mat> const allObjPoints(
+      _charucoIds.total(),
+      Mat(1, ProductionBoard::nCorners, CV_32FC3,
+          const_cast<Point3f *>(boardPoints.data())));
+  vector<Point3f> newObjPoints(boardPoints.begin(), boardPoints.end());
+#else
   // Join object points of charuco corners in a single vector for
   // calibrateCamera() function
   vector<vector<Point3f>> allObjPoints;
@@ -219,10 +1438,15 @@ double calibrateCameraCharucoRO(InputArrayOfArrays _charucoCorners,
     objPointsImg[iFix].x = objPointsImg[0].x + grid_width;
   }
   auto newObjPoints = allObjPoints[0];
+#endif
 
-  auto const rms = calibrateCameraRO(allObjPoints, _charucoCorners, imageSize,
-                                     iFix, _cameraMatrix, _distCoeffs,
-                                     noArray(), noArray(), newObjPoints, flags);
+  auto const rms =
+      sparse ? calibrateCameraSparseRO(allObjPoints, _charucoCorners,
+                                       _charucoIds, iFix, _cameraMatrix,
+                                       _distCoeffs, flags, nJobs, newObjPoints)
+             : calibrateCameraRO(allObjPoints, _charucoCorners, imageSize,
+                                 iFix, _cameraMatrix, _distCoeffs, noArray(),
+                                 noArray(), newObjPoints, flags);
 
   cout << "New board corners: " << endl;
   cout << newObjPoints[0] << endl;
@@ -258,6 +1482,15 @@ int main(int argc, char *argv[]) {
       parser.get<bool>("show_detected_chessboard");
   bool const isTestRun = parser.get<bool>("test");
   bool const verbose = parser.get<bool>("verbose");
+  bool const streaming = parser.get<bool>("streaming");
+  bool const sparseRO = parser.get<bool>("sparse_ro");
+  bool const onlineCalibration = parser.get<bool>("online");
+  string const cacheFileName = parser.get<string>("detection_cache");
+  string const profileFileName = parser.get<string>("profile");
+  string const referenceFileName = parser.get<string>("reference");
+  StageProfile stageProfile;
+  StageProfile *const profile =
+      profileFileName.empty() ? nullptr : &stageProfile;
 
   int calibrationFlags = 0;
   Mat cameraMatrix = Mat::eye(3, 3, CV_64F);
@@ -291,12 +1524,49 @@ int main(int argc, char *argv[]) {
 
   bool const refindStrategy = parser.get<bool>("refind_strategy");
   int const camId = parser.get<int>("camera_id");
+  string const videoFileName = parser.get<string>("video");
+  bool const autoCapture = parser.get<bool>("auto_capture");
+  bool const showPreview = !parser.get<bool>("no_preview");
+  if (!showPreview && !autoCapture) {
+    cerr << "Without a preview, there is no way to capture frames manually. "
+            "Use auto_capture"
+         << endl;
+    return 0;
+  }
+  // Without a preview, capturing only stops at the end of the input, and a
+  // camera never ends
+  if (!showPreview && imageListFileName.empty() && videoFileName.empty()) {
+    cerr << "Without a preview, there is no way to stop capturing from a "
+            "camera. Use video"
+         << endl;
+    return 0;
+  }
+  int const lutStep = parser.get<int>("binary_params_lut_step");
+  if (lutStep <= 0) {
+    cerr << "binary_params_lut_step must be positive" << endl;
+    return 0;
+  }
+  int nJobs = parser.get<int>("jobs");
+  if (nJobs <= 0)
+    nJobs = std::max(1, (int)thread::hardware_concurrency());
 
   if (!parser.check()) {
     parser.printErrors();
     return 0;
   }
 
+#ifdef FIXED_BOARD
+  if (squaresX != ProductionBoard::squaresX ||
+      squaresY != ProductionBoard::squaresY ||
+      dictionaryId != ProductionBoard::dictionary) {
+    cerr << "This build only supports the " << ProductionBoard::squaresX
+         << "x" << ProductionBoard::squaresY << " board with dictionary "
+         << ProductionBoard::dictionary
+         << ". Build without --fixed-board for other boards" << endl;
+    return 0;
+  }
+#endif
+
   Ptr<aruco::Dictionary> const dictionary = aruco::getPredefinedDictionary(
       aruco::PREDEFINED_DICTIONARY_NAME(dictionaryId));
 
@@ -305,117 +1575,132 @@ int main(int argc, char *argv[]) {
       squaresX, squaresY, squareLength, markerLength, dictionary);
   Ptr<aruco::Board> const board = charucoboard.staticCast<aruco::Board>();
 
+  DetectionSettings detection;
+  detection.dictionary = dictionary;
+  detection.detectorParams = detectorParams;
+  detection.charucoboard = charucoboard;
+  detection.refindStrategy = refindStrategy;
+  detection.profile = profile;
+
   // collect data from each frame
-  vector<vector<vector<Point2f>>> allCorners;
-  vector<vector<int>> allIds;
-  vector<Mat> allImgs;
+  // Images are empty in streaming mode, and for frames found in the detection
+  // cache, except for camera frames which can't be re-read
+  vector<FrameDetection> allFrames;
   Size imgSize{0, 0};
+  bool const useCache = !cacheFileName.empty();
+  DetectionCache cache;
   //
   // Done with initializations stuff
   //
   if (imageListFileName.empty()) {
-    cout << "Grabbing video from cam nr " << camId << endl;
-    VideoCapture inputVideo;
-    inputVideo.open(camId);
-
-    while (inputVideo.grab()) {
-      Mat image;
-      inputVideo.retrieve(image);
-
-      vector<int> ids;
-      vector<vector<Point2f>> corners;
-      vector<vector<Point2f>> rejected;
-
-      // detect markers
-      aruco::detectMarkers(image, dictionary, corners, ids, detectorParams,
-                           rejected);
-
-      // refind strategy to detect more markers
-      if (refindStrategy) {
-        aruco::refineDetectedMarkers(image, board, corners, ids, rejected);
-      }
-
-      // interpolate charuco corners
-      Mat currentCharucoCorners;
-      Mat currentCharucoIds;
-      if (ids.size() > 0) {
-        aruco::interpolateCornersCharuco(corners, ids, image, charucoboard,
-                                         currentCharucoCorners,
-                                         currentCharucoIds);
-      }
-
-      // draw results
-      Mat imageCopy;
-      image.copyTo(imageCopy);
-      if (ids.size() > 0) {
-        aruco::drawDetectedMarkers(imageCopy, corners);
-      }
-
-      if (currentCharucoCorners.total() > 0) {
-        aruco::drawDetectedCornersCharuco(imageCopy, currentCharucoCorners,
-                                          currentCharucoIds);
-      }
-
-      putText(imageCopy,
-              "Press 'c' to add current frame. 'ESC' to finish and calibrate",
-              Point(10, 20), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(255, 0, 0), 2);
-
-      imshow("out", imageCopy);
-      char key = (char)waitKey(10);
-      if (key == 27)
-        break;
-      if (key == 'c' && ids.size() > 0) {
-        cout << "Frame captured" << endl;
-        allCorners.push_back(corners);
-        allIds.push_back(ids);
-        allImgs.push_back(image);
-        imgSize = image.size();
-      }
+    FrameSource source;
+    if (videoFileName.empty())
+      cout << "Grabbing video from cam nr " << camId << endl;
+    else
+      cout << "Reading video from " << videoFileName << endl;
+    if (!source.open(videoFileName, camId)) {
+      cerr << "Cannot open video input" << endl;
+      return 0;
     }
+    OnlineCalibration online(charucoboard, cameraMatrix, calibrationFlags,
+                             nJobs);
+    allFrames = captureFrames(source, detection, autoCapture, showPreview,
+                              streaming, onlineCalibration ? &online : nullptr);
+    if (!allFrames.empty())
+      imgSize = allFrames.back().imageSize;
   } else {
     cout << "Reading from image list " << imageListFileName << endl;
     vector<string> imageList{};
     readStringList(samples::findFile(imageListFileName), imageList);
-    for (auto const &imageName : imageList) {
-
-      Mat const image = imread(imageName, 1);
-      vector<int> ids;
-      vector<vector<Point2f>> corners;
-      vector<vector<Point2f>> rejected;
-      // detect markers
-      aruco::detectMarkers(image, dictionary, corners, ids, detectorParams,
-                           rejected);
-      // refind strategy to detect more markers
-      if (refindStrategy) {
-        aruco::refineDetectedMarkers(image, board, corners, ids, rejected);
+
+    string const settingsHash =
+        detectionSettingsHash(detection, squaresX, squaresY, squareLength,
+                              markerLength, dictionaryId);
+    if (useCache) {
+      utils::fs::createDirectories(cornerPatchesDirectory(cacheFileName));
+      cache = readDetectionCache(cacheFileName, settingsHash);
+      cout << "Found " << cache.frames.size() << " cached detections in "
+           << cacheFileName << endl;
+    }
+
+    // Decode and detect on all cores. Each worker writes into its own slot,
+    // so the frames come out in list order regardless of scheduling.
+    int const nImages = (int)imageList.size();
+    vector<FrameDetection> frames(nImages);
+    atomic<int> nCacheHits{0};
+    parallelForEach(nImages, nJobs, [&](int const i) {
+      frames[i].name = imageList[i];
+      if (useCache) {
+        vector<uchar> const bytes = readFileBytes(imageList[i]);
+        frames[i].contentHash = toHex(fnv1a(bytes.data(), bytes.size()));
+        auto const cached = cache.frames.find(imageList[i]);
+        if (cached != cache.frames.end() &&
+            cached->second.contentHash == frames[i].contentHash) {
+          frames[i] = cached->second;
+          ++nCacheHits;
+          return;
+        }
+        StageProfile::Timer const timer(profile, StageProfile::Imread);
+        frames[i].image = imdecode(bytes, 1);
+      } else {
+        StageProfile::Timer const timer(profile, StageProfile::Imread);
+        frames[i].image = imread(imageList[i], 1);
       }
-      // interpolate charuco corners
-      Mat currentCharucoCorners;
-      Mat currentCharucoIds;
-      if (ids.size() > 0) {
-        aruco::interpolateCornersCharuco(corners, ids, image, charucoboard,
-                                         currentCharucoCorners,
-                                         currentCharucoIds);
+      detectCharuco(frames[i], detection);
+      if (streaming || useCache)
+        frames[i].patches = cutCornerPatches(frames[i].image, frames[i],
+                                             *detection.charucoboard);
+      // Later runs interpolate with the stored patches instead of decoding
+      if (useCache && !frames[i].patches.ids.empty() &&
+          !imwrite(cornerPatchesFileName(cacheFileName,
+                                         frames[i].contentHash),
+                   frames[i].patches.pixels))
+        frames[i].patches = CornerPatches();
+      // A test run only shows the images, one at a time, and re-reads them
+      // for that, so don't hold all of them in memory until then
+      if (streaming) {
+        frames[i].image.release();
+      } else {
+        frames[i].patches.pixels.release();
+        if (isTestRun)
+          frames[i].image.release();
       }
+    });
+
+    if (useCache) {
+      cout << "Reused cached detections for " << nCacheHits << " of "
+           << nImages << " images" << endl;
+      cache.settingsHash = settingsHash;
+      cache.frames.clear();
+      for (auto const &frame : frames)
+        cache.frames[frame.name] = withoutImage(frame);
+      if (!writeDetectionCache(cacheFileName, cache))
+        cerr << "Cannot write detection cache " << cacheFileName << endl;
+    }
+
+    for (auto &frame : frames) {
       if (verbose) {
-        cout << "Using image " << imageName << " found " << corners.size()
-             << " aruco tags and " << currentCharucoIds.size() << " corners"
-             << endl;
+        cout << "Using image " << frame.name << " found "
+             << frame.corners.size() << " aruco tags and "
+             << frame.charucoIds.size() << " corners" << endl;
       }
 
       if (isTestRun) {
         // draw results
         Mat imageCopy;
-        image.copyTo(imageCopy);
-        if (ids.size() > 0)
-          aruco::drawDetectedMarkers(imageCopy, corners);
-        if (currentCharucoCorners.total() > 0)
-          aruco::drawDetectedCornersCharuco(imageCopy, currentCharucoCorners,
-                                            currentCharucoIds);
+        if (frame.image.empty())
+          imageCopy = imread(frame.name, 1);
+        else
+          frame.image.copyTo(imageCopy);
+        if (frame.ids.size() > 0)
+          aruco::drawDetectedMarkers(imageCopy, frame.corners);
+        if (frame.charucoCorners.total() > 0)
+          aruco::drawDetectedCornersCharuco(imageCopy, frame.charucoCorners,
+                                            frame.charucoIds);
         Size const size{1280, 960};
         resize(imageCopy, imageCopy, size);
-        putText(imageCopy, imageName, Point(10, 30), FONT_HERSHEY_SIMPLEX, 1.0,
-                Scalar(255, 0, 0), 2);
+        putText(imageCopy, frame.name, Point(10, 30), FONT_HERSHEY_SIMPLEX,
+                1.0, Scalar(255, 0, 0), 2);
         putText(imageCopy, "Did your aruco markers get detected?",
                 Point(10, 65), FONT_HERSHEY_SIMPLEX, 1.0, Scalar(255, 0, 0), 2);
         putText(imageCopy, "Press any key to go to next image.", Point(10, 100),
@@ -429,10 +1714,8 @@ int main(int argc, char *argv[]) {
       }
 
       if (!isTestRun) {
-        allCorners.push_back(corners);
-        allIds.push_back(ids);
-        allImgs.push_back(image);
-        imgSize = image.size();
+        imgSize = frame.imageSize;
+        allFrames.push_back(std::move(frame));
       }
     }
   }
@@ -441,7 +1724,7 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  if (allIds.size() < 1) {
+  if (allFrames.size() < 1) {
     cerr << "Not enough captures for calibration" << endl;
     return 0;
   }
@@ -450,13 +1733,13 @@ int main(int argc, char *argv[]) {
   vector<vector<Point2f>> allCornersConcatenated;
   vector<int> allIdsConcatenated;
   vector<int> markerCounterPerFrame;
-  markerCounterPerFrame.reserve(allCorners.size());
+  markerCounterPerFrame.reserve(allFrames.size());
 
-  for (unsigned int i{0}; i < allCorners.size(); ++i) {
-    markerCounterPerFrame.push_back((int)allCorners[i].size());
-    for (unsigned int j{0}; j < allCorners[i].size(); ++j) {
-      allCornersConcatenated.push_back(allCorners[i][j]);
-      allIdsConcatenated.push_back(allIds[i][j]);
+  for (auto const &frame : allFrames) {
+    markerCounterPerFrame.push_back((int)frame.corners.size());
+    for (unsigned int j{0}; j < frame.corners.size(); ++j) {
+      allCornersConcatenated.push_back(frame.corners[j]);
+      allIdsConcatenated.push_back(frame.ids[j]);
     }
   }
 
@@ -471,41 +1754,113 @@ int main(int argc, char *argv[]) {
 
   // calibrate camera using aruco markers
   Mat distCoeffs;
-  double const arucoRepErr = aruco::calibrateCameraAruco(
-      allCornersConcatenated, allIdsConcatenated, markerCounterPerFrame, board,
-      imgSize, cameraMatrix, distCoeffs, noArray(), noArray(),
-      calibrationFlags);
+  double arucoRepErr{0.0};
+  {
+    StageProfile::Timer const timer(profile,
+                                    StageProfile::CalibrateCameraAruco);
+    arucoRepErr = aruco::calibrateCameraAruco(
+        allCornersConcatenated, allIdsConcatenated, markerCounterPerFrame,
+        board, imgSize, cameraMatrix, distCoeffs, noArray(), noArray(),
+        calibrationFlags);
+  }
 
   // prepare data for charuco calibration
-  int const nFrames = (int)allCorners.size();
-  vector<Mat> allCharucoCorners;
-  vector<Mat> allCharucoIds;
-  vector<Mat> filteredImages;
-  allCharucoCorners.reserve(nFrames);
-  allCharucoIds.reserve(nFrames);
-  filteredImages.reserve(nFrames);
-  for (int i{0}; i < nFrames; ++i) {
+  int const nFrames = (int)allFrames.size();
+  vector<Mat> allCharucoCorners(nFrames);
+  vector<Mat> allCharucoIds(nFrames);
+  // The cached interpolations are only valid for the exact same camera
+  // parameters, so solver flags that don't touch the aruco calibration still
+  // get a warm start
+  string const cameraHash = cameraParamsHash(cameraMatrix, distCoeffs);
+  bool const cachedCameraMatches = useCache && cache.cameraHash == cameraHash;
+  atomic<int> nDecodedAgain{0};
+  parallelForEach(nFrames, nJobs, [&](int const i) {
+    FrameDetection &frame = allFrames[i];
+    if (cachedCameraMatches && !frame.calibratedCharucoIds.empty()) {
+      allCharucoCorners[i] = frame.calibratedCharucoCorners;
+      allCharucoIds[i] = frame.calibratedCharucoIds;
+      return;
+    }
+    if (frame.ids.empty())
+      return;
+    // Streamed frames have their patches in memory, cached ones next to the
+    // cache
+    CornerPatches patches = frame.patches;
+    if (frame.image.empty() && patches.pixels.empty() && useCache &&
+        !patches.ids.empty()) {
+      StageProfile::Timer const timer(profile, StageProfile::Imread);
+      patches.pixels =
+          imread(cornerPatchesFileName(cacheFileName, frame.contentHash),
+                 IMREAD_GRAYSCALE);
+    }
+    if (frame.image.empty() &&
+        patches.pixels.rows == CornerPatches::side * (int)patches.ids.size() &&
+        patches.pixels.cols == CornerPatches::side) {
+      StageProfile::Timer const timer(profile,
+                                      StageProfile::InterpolateCornersCharuco);
+      int const nLeftOut = interpolateInCornerPatches(
+          frame, patches, charucoboard, cameraMatrix, distCoeffs,
+          allCharucoCorners[i], allCharucoIds[i]);
+      // Camera frames can't be read again, they do without those corners
+      if (nLeftOut == 0 || frame.name.empty())
+        return;
+    }
+    // Cached detections have no image, at most one per thread is read here
+    Mat image = frame.image;
+    if (image.empty()) {
+      StageProfile::Timer const timer(profile, StageProfile::Imread);
+      image = imreadGrey(frame.name);
+      ++nDecodedAgain;
+      // Detections cached before there were corner patches get them now
+      if (useCache && frame.patches.ids.empty()) {
+        CornerPatches const fresh =
+            cutCornerPatches(image, frame, *charucoboard);
+        if (!fresh.ids.empty() &&
+            imwrite(cornerPatchesFileName(cacheFileName, frame.contentHash),
+                    fresh.pixels)) {
+          frame.patches.ids = fresh.ids;
+          frame.patches.origins = fresh.origins;
+        }
+      }
+    }
     // interpolate using camera parameters
-    Mat currentCharucoCorners;
-    Mat currentCharucoIds;
-    aruco::interpolateCornersCharuco(
-        allCorners[i], allIds[i], allImgs[i], charucoboard,
-        currentCharucoCorners, currentCharucoIds, cameraMatrix, distCoeffs);
-
-    allCharucoCorners.push_back(currentCharucoCorners);
-    allCharucoIds.push_back(currentCharucoIds);
-    filteredImages.push_back(allImgs[i]);
+    StageProfile::Timer const timer(profile,
+                                    StageProfile::InterpolateCornersCharuco);
+    aruco::interpolateCornersCharuco(frame.corners, frame.ids, image,
+                                     charucoboard, allCharucoCorners[i],
+                                     allCharucoIds[i], cameraMatrix,
+                                     distCoeffs);
+  });
+  if (nDecodedAgain > 0)
+    cout << "Decoded " << nDecodedAgain << " of " << nFrames
+         << " images again to interpolate their charuco corners" << endl;
+
+  if (useCache && !imageListFileName.empty()) {
+    cache.cameraHash = cameraHash;
+    for (int i{0}; i < nFrames; ++i) {
+      FrameDetection &cached = cache.frames[allFrames[i].name];
+      cached.calibratedCharucoCorners = allCharucoCorners[i];
+      cached.calibratedCharucoIds = allCharucoIds[i];
+      cached.patches.ids = allFrames[i].patches.ids;
+      cached.patches.origins = allFrames[i].patches.origins;
+    }
+    if (!writeDetectionCache(cacheFileName, cache))
+      cerr << "Cannot write detection cache " << cacheFileName << endl;
   }
-
   if (allCharucoCorners.size() < 4) {
     cerr << "Not enough corners for calibration" << endl;
     return 0;
   }
 
   // calibrate camera using charuco
-  double const repError = calibrateCameraCharucoRO(
-      allCharucoCorners, allCharucoIds, charucoboard, imgSize, cameraMatrix,
-      distCoeffs, calibrationFlags, squaresX - 2, grid_width);
+  double repError{0.0};
+  {
+    StageProfile::Timer const timer(profile, StageProfile::CalibrateCameraRO);
+    repError = calibrateCameraCharucoRO(
+        allCharucoCorners, allCharucoIds, charucoboard, imgSize, cameraMatrix,
+        distCoeffs, calibrationFlags, squaresX - 2, grid_width, sparseRO,
+        nJobs);
+  }
 
   bool saveOk = saveCameraParams(outputFile, imgSize, calibrationFlags,
                                  cameraMatrix, distCoeffs, repError);
@@ -517,11 +1872,49 @@ int main(int argc, char *argv[]) {
   cout << "Reprojection Error: " << repError << endl;
   cout << "Calibration saved to " << outputFile << endl;
 
+  if (parser.has("binary_params")) {
+    string const binaryParamsFile = parser.get<string>("binary_params");
+    if (!saveBinaryCameraParams(binaryParamsFile, imgSize, cameraMatrix,
+                                distCoeffs, repError, lutStep)) {
+      cerr << "Cannot save binary params file" << endl;
+      return 0;
+    }
+    cout << "Binary params saved to " << binaryParamsFile << endl;
+  }
+
+  if (profile != nullptr) {
+    profile->set("jobs", nJobs);
+#ifdef FIXED_BOARD
+    profile->set("fixed_board", 1);
+#else
+    profile->set("fixed_board", 0);
+#endif
+    profile->set("frames", nFrames);
+    profile->set("aruco_reprojection_error", arucoRepErr);
+    profile->set("reprojection_error", repError);
+    if (!referenceFileName.empty() &&
+        !compareWithReference(referenceFileName, cameraMatrix, distCoeffs,
+                              *profile)) {
+      cerr << "Cannot read reference camera params " << referenceFileName
+           << endl;
+    }
+    if (!profile->writeJson(profileFileName))
+      cerr << "Cannot write profile " << profileFileName << endl;
+    else
+      cout << "Profile saved to " << profileFileName << endl;
+  }
+
   // show interpolated charuco corners for debugging
   if (showChessboardCorners) {
-    for (unsigned int frame = 0; frame < filteredImages.size(); frame++) {
-      Mat imageCopy = filteredImages[frame].clone();
-      if (allIds[frame].size() > 0) {
+    for (unsigned int frame = 0; frame < allFrames.size(); frame++) {
+      Mat imageCopy = allFrames[frame].image.empty()
+                          ? imread(allFrames[frame].name, 1)
+                          : allFrames[frame].image.clone();
+      if (imageCopy.empty())
+        continue; // Camera frames in streaming mode
+      if (imageCopy.channels() == 1)
+        cvtColor(imageCopy, imageCopy, COLOR_GRAY2BGR);
+      if (allFrames[frame].ids.size() > 0) {
 
         if (allCharucoCorners[frame].total() > 0) {
           aruco::drawDetectedCornersCharuco(imageCopy, allCharucoCorners[frame],
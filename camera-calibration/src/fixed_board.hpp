@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <opencv2/core.hpp>
+
+/** A charuco board layout known at compile time.
+ *
+ * Builds made with ./make --fixed-board (-DFIXED_BOARD) only support
+ * ProductionBoard, so the corner count and the corner id to board position
+ * mapping are constants, and the object points fit in a std::array. The
+ * lengths are still read at run time, since they are measured on the print.
+ */
+template <int SquaresX, int SquaresY, int Dictionary> struct FixedCharucoBoard {
+  static constexpr int squaresX{SquaresX};
+  static constexpr int squaresY{SquaresY};
+  static constexpr int dictionary{Dictionary};
+  static constexpr int nCorners{(SquaresX - 1) * (SquaresY - 1)};
+  using ObjectPoints = std::array<cv::Point3f, nCorners>;
+
+  /** Corner position in squares, like CharucoBoard::create() places them */
+  static constexpr int cornerColumn(int const id) {
+    return id % (SquaresX - 1) + 1;
+  }
+  static constexpr int cornerRow(int const id) {
+    return id / (SquaresX - 1) + 1;
+  }
+
+  /** Every corner, in id order, with corner iFix moved to the end of the
+   * measured grid width like calibrateCameraCharucoRO() does
+   */
+  static ObjectPoints objectPoints(float const squareLength, int const iFix,
+                                   float const gridWidth) {
+    ObjectPoints points;
+    for (int id{0}; id < nCorners; ++id)
+      points[id] = cv::Point3f(squareLength * cornerColumn(id),
+                               squareLength * cornerRow(id), 0.0f);
+    points[iFix].x = points[0].x + gridWidth;
+    return points;
+  }
+
+  /** True if the frame has every corner, in id order */
+  static bool hasAllCorners(cv::Mat const &ids) {
+    if ((int)ids.total() != nCorners)
+      return false;
+    for (int id{0}; id < nCorners; ++id)
+      if (ids.at<int>(id) != id)
+        return false;
+    return true;
+  }
+};
+
+/** 16 x 11 squares of DICT_ARUCO_ORIGINAL markers */
+using ProductionBoard = FixedCharucoBoard<16, 11, 16>;
+static_assert(ProductionBoard::nCorners == 150, "16 x 11 squares");
+static_assert(ProductionBoard::cornerColumn(14) == 15 &&
+                  ProductionBoard::cornerRow(15) == 2,
+              "Same corner order as CharucoBoard::create()");
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Run body(i) for every i in [0, n) on nJobs threads.
+ * body must only write to slot i of its outputs, so the result never depends
+ * on the order in which the threads happen to pick up work.
+ */
+template <typename Body>
+void parallelForEach(int const n, int const nJobs, Body const &body) {
+  int const nThreads = std::max(1, std::min(nJobs, n));
+  if (nThreads == 1) {
+    for (int i{0}; i < n; ++i)
+      body(i);
+    return;
+  }
+
+  std::atomic<int> next{0};
+  std::exception_ptr firstError{nullptr};
+  std::mutex errorMutex;
+  std::vector<std::thread> workers;
+  workers.reserve(nThreads);
+  for (int t{0}; t < nThreads; ++t) {
+    workers.emplace_back([&]() {
+      for (int i{next++}; i < n; i = next++) {
+        try {
+          body(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> const lock(errorMutex);
+          if (!firstError)
+            firstError = std::current_exception();
+          next = n; // Stop handing out more work
+        }
+      }
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+  if (firstError)
+    std::rethrow_exception(firstError);
+}
@@ -0,0 +1,563 @@
+#include "sparse_ro_solver.hpp"
+#include "parallel_for_each.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <opencv2/calib3d.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace {
+
+/** Rotation matrix of the Rodrigues vector w, row-major */
+array<double, 9> rotationFromRodrigues(double const w0, double const w1,
+                                       double const w2) {
+  double const theta = sqrt(w0 * w0 + w1 * w1 + w2 * w2);
+  array<double, 9> R{1, 0, 0, 0, 1, 0, 0, 0, 1};
+  if (theta < 1e-12) {
+    R[1] = -w2;
+    R[2] = w1;
+    R[3] = w2;
+    R[5] = -w0;
+    R[6] = -w1;
+    R[7] = w0;
+    return R;
+  }
+  double const x = w0 / theta, y = w1 / theta, z = w2 / theta;
+  double const s = sin(theta), c = 1 - cos(theta);
+  R[0] += c * (x * x - 1);
+  R[1] += -s * z + c * x * y;
+  R[2] += s * y + c * x * z;
+  R[3] += s * z + c * x * y;
+  R[4] += c * (y * y - 1);
+  R[5] += -s * x + c * y * z;
+  R[6] += -s * y + c * x * z;
+  R[7] += s * x + c * y * z;
+  R[8] += c * (z * z - 1);
+  return R;
+}
+
+array<double, 9> multiply(array<double, 9> const &A,
+                          array<double, 9> const &B) {
+  array<double, 9> C{};
+  for (int r{0}; r < 3; ++r)
+    for (int c{0}; c < 3; ++c)
+      for (int k{0}; k < 3; ++k)
+        C[3 * r + c] += A[3 * r + k] * B[3 * k + c];
+  return C;
+}
+
+/** Project the camera frame point q with the OpenCV pinhole and distortion
+ * model. If G is given it receives d(u, v) / dq (2x3), and Ja receives
+ * d(u, v) / d(intrinsics) (2x9).
+ */
+void project(SparseROSolver::Intrinsics const &a, double const *q, double &u,
+             double &v, double *G = nullptr, double *Ja = nullptr) {
+  double const fx = a[0], fy = a[1], cx = a[2], cy = a[3];
+  double const k1 = a[4], k2 = a[5], p1 = a[6], p2 = a[7], k3 = a[8];
+  double const iz = 1 / q[2];
+  double const x = q[0] * iz, y = q[1] * iz;
+  double const r2 = x * x + y * y, r4 = r2 * r2, r6 = r4 * r2;
+  double const radial = 1 + k1 * r2 + k2 * r4 + k3 * r6;
+  double const xd = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+  double const yd = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+  u = fx * xd + cx;
+  v = fy * yd + cy;
+  if (!G)
+    return;
+
+  double const dRadial = k1 + 2 * k2 * r2 + 3 * k3 * r4;
+  double const dxdx = radial + 2 * x * x * dRadial + 2 * p1 * y + 6 * p2 * x;
+  double const dxdy = 2 * x * y * dRadial + 2 * p1 * x + 2 * p2 * y;
+  double const dydy = radial + 2 * y * y * dRadial + 6 * p1 * y + 2 * p2 * x;
+  // d(x, y) / dq = [iz, 0, -x iz; 0, iz, -y iz]
+  G[0] = fx * dxdx * iz;
+  G[1] = fx * dxdy * iz;
+  G[2] = -fx * (dxdx * x + dxdy * y) * iz;
+  G[3] = fy * dxdy * iz;
+  G[4] = fy * dydy * iz;
+  G[5] = -fy * (dxdy * x + dydy * y) * iz;
+
+  double const du[9]{xd,          0,           1,
+                     0,           fx * x * r2, fx * x * r4,
+                     fx * 2 * x * y, fx * (r2 + 2 * x * x), fx * x * r6};
+  double const dv[9]{0,           yd,          0,
+                     1,           fy * y * r2, fy * y * r4,
+                     fy * (r2 + 2 * y * y), fy * 2 * x * y, fy * y * r6};
+  copy(du, du + 9, Ja);
+  copy(dv, dv + 9, Ja + 9);
+}
+
+/** In-place Cholesky factorisation of the symmetric n x n matrix A.
+ * Returns false if A is not positive definite.
+ */
+bool cholesky(double *A, int const n) {
+  for (int j{0}; j < n; ++j) {
+    double *Aj = A + j * n;
+    double d = Aj[j];
+    for (int k{0}; k < j; ++k)
+      d -= Aj[k] * Aj[k];
+    if (!(d > 0))
+      return false;
+    d = sqrt(d);
+    Aj[j] = d;
+    for (int i{j + 1}; i < n; ++i) {
+      double *Ai = A + i * n;
+      double s = Ai[j];
+      for (int k{0}; k < j; ++k)
+        s -= Ai[k] * Aj[k];
+      Ai[j] = s / d;
+    }
+  }
+  return true;
+}
+
+/** Solve L L^T x = b in place, with L from cholesky() */
+void choleskySolve(double const *L, int const n, double *b) {
+  for (int i{0}; i < n; ++i) {
+    for (int k{0}; k < i; ++k)
+      b[i] -= L[i * n + k] * b[k];
+    b[i] /= L[i * n + i];
+  }
+  for (int i{n - 1}; i >= 0; --i) {
+    for (int k{i + 1}; k < n; ++k)
+      b[i] -= L[k * n + i] * b[k];
+    b[i] /= L[i * n + i];
+  }
+}
+
+} // namespace
+
+SparseROSolver::SparseROSolver(Intrinsics const &intrinsics,
+                               vector<Point3f> const &boardPoints,
+                               vector<int> const &fixedCoordinates,
+                               int const flags,
+                               int const nJobs)
+    : intrinsics_(intrinsics), nJobs_(std::max(1, nJobs)) {
+  for (auto const &p : boardPoints)
+    points_.push_back({p.x, p.y, p.z});
+  fixed_.assign(nShared(), 0);
+  if (flags & CALIB_FIX_PRINCIPAL_POINT)
+    fixed_[2] = fixed_[3] = 1;
+  if (flags & CALIB_ZERO_TANGENT_DIST) {
+    intrinsics_[6] = intrinsics_[7] = 0;
+    fixed_[6] = fixed_[7] = 1;
+  }
+  for (int const k : fixedCoordinates) {
+    CV_Assert(k >= 0 && k < 3 * int(points_.size()));
+    fixed_[9 + k] = 1;
+  }
+}
+
+void SparseROSolver::addFrame(vector<int> const &pointIds,
+                              vector<Point2f> const &imagePoints,
+                              Vec3d const &rvec, Vec3d const &tvec) {
+  CV_Assert(pointIds.size() == imagePoints.size());
+  // Keep the observations sorted by point id so that the shared parameters a
+  // frame couples to come in increasing order
+  vector<int> order(pointIds.size());
+  for (size_t j{0}; j < order.size(); ++j) {
+    CV_Assert(pointIds[j] >= 0 && pointIds[j] < int(points_.size()));
+    order[j] = int(j);
+  }
+  sort(order.begin(), order.end(),
+       [&](int const a, int const b) { return pointIds[a] < pointIds[b]; });
+  Frame frame{{}, {}, rotationFromRodrigues(rvec[0], rvec[1], rvec[2]),
+              {tvec[0], tvec[1], tvec[2]}};
+  for (int const j : order) {
+    CV_Assert(frame.pointIds.empty() || frame.pointIds.back() != pointIds[j]);
+    frame.pointIds.push_back(pointIds[j]);
+    frame.imagePoints.push_back(imagePoints[j]);
+  }
+  frames_.push_back(move(frame));
+}
+
+vector<Point3f> SparseROSolver::boardPoints() const {
+  vector<Point3f> points;
+  points.reserve(points_.size());
+  for (auto const &p : points_)
+    points.emplace_back(float(p[0]), float(p[1]), float(p[2]));
+  return points;
+}
+
+double SparseROSolver::cost(Intrinsics const &intrinsics,
+                            vector<array<double, 3>> const &points,
+                            vector<Frame> const &frames) const {
+  vector<double> frameCost(frames.size(), 0);
+  parallelForEach(int(frames.size()), nJobs_, [&](int const i) {
+    auto const &frame = frames[i];
+    auto const &R = frame.R;
+    double sum{0};
+    for (size_t j{0}; j < frame.pointIds.size(); ++j) {
+      auto const &X = points[frame.pointIds[j]];
+      double const q[3]{
+          R[0] * X[0] + R[1] * X[1] + R[2] * X[2] + frame.t[0],
+          R[3] * X[0] + R[4] * X[1] + R[5] * X[2] + frame.t[1],
+          R[6] * X[0] + R[7] * X[1] + R[8] * X[2] + frame.t[2]};
+      double u, v;
+      project(intrinsics, q, u, v);
+      double const du = u - frame.imagePoints[j].x;
+      double const dv = v - frame.imagePoints[j].y;
+      sum += du * du + dv * dv;
+    }
+    frameCost[i] = sum;
+  });
+  double total{0};
+  for (double const c : frameCost)
+    total += c;
+  return total;
+}
+
+/** Board points that no frame sees are not constrained, keep them put.
+ * Number the remaining free shared parameters in order, so that a frame's
+ * columns in the reduced system come in increasing order.
+ */
+void SparseROSolver::findFreeParameters() {
+  vector<char> seen(points_.size(), 0);
+  for (auto const &frame : frames_)
+    for (int const id : frame.pointIds)
+      seen[id] = 1;
+  freeIndex_.assign(nShared(), -1);
+  nFree_ = 0;
+  for (int k{0}; k < nShared(); ++k)
+    if (!fixed_[k] && (k < 9 || seen[(k - 9) / 3]))
+      freeIndex_[k] = nFree_++;
+}
+
+/** Fill the per-frame blocks and the dense shared block U and gradient g,
+ * over the free shared parameters.
+ * Frames are split into one contiguous chunk per job and the chunk sums are
+ * added up in order, so the result does not depend on thread scheduling.
+ */
+void SparseROSolver::buildNormalEquations(vector<double> &U,
+                                          vector<double> &g) {
+  int const n = nFree_;
+  int const nFrames = int(frames_.size());
+  int const nChunks = std::min(nJobs_, std::max(1, nFrames));
+  vector<vector<double>> chunkU(nChunks, vector<double>(n * n, 0));
+  vector<vector<double>> chunkG(nChunks, vector<double>(n, 0));
+  systems_.resize(nFrames);
+
+  parallelForEach(nChunks, nJobs_, [&](int const chunk) {
+    double *Uc = chunkU[chunk].data();
+    double *gc = chunkG[chunk].data();
+    for (int i{chunk * nFrames / nChunks}; i < (chunk + 1) * nFrames / nChunks;
+         ++i) {
+      auto const &frame = frames_[i];
+      auto const &R = frame.R;
+      auto &sys = systems_[i];
+      int const nObs = int(frame.pointIds.size());
+      sys.V.fill(0);
+      sys.g.fill(0);
+      // Column of each free intrinsic and board point coordinate in W, or -1
+      int intrinsicCol[9];
+      vector<int> pointCol(3 * nObs, -1);
+      sys.cols.clear();
+      for (int k{0}; k < 9; ++k) {
+        intrinsicCol[k] = freeIndex_[k] < 0 ? -1 : int(sys.cols.size());
+        if (freeIndex_[k] >= 0)
+          sys.cols.push_back(freeIndex_[k]);
+      }
+      for (int j{0}; j < nObs; ++j) {
+        for (int c{0}; c < 3; ++c) {
+          int const f = freeIndex_[9 + 3 * frame.pointIds[j] + c];
+          if (f < 0)
+            continue;
+          pointCol[3 * j + c] = int(sys.cols.size());
+          sys.cols.push_back(f);
+        }
+      }
+      int const nc = int(sys.cols.size());
+      sys.W.assign(6 * nc, 0);
+
+      for (int j{0}; j < nObs; ++j) {
+        int const id = frame.pointIds[j];
+        auto const &X = points_[id];
+        double const p[3]{R[0] * X[0] + R[1] * X[1] + R[2] * X[2],
+                          R[3] * X[0] + R[4] * X[1] + R[5] * X[2],
+                          R[6] * X[0] + R[7] * X[1] + R[8] * X[2]};
+        double const q[3]{p[0] + frame.t[0], p[1] + frame.t[1],
+                          p[2] + frame.t[2]};
+        double u, v, G[6], Ja[18];
+        project(intrinsics_, q, u, v, G, Ja);
+        double const r[2]{u - frame.imagePoints[j].x,
+                          v - frame.imagePoints[j].y};
+
+        // Pose: rotation update R <- exp(w) R moves q by w x p, so
+        // dq / dw = -[p]x, and dq / dt = I
+        double Jc[12], Jp[6];
+        for (int row{0}; row < 2; ++row) {
+          double const *Gr = G + 3 * row;
+          Jc[6 * row + 0] = Gr[2] * p[1] - Gr[1] * p[2];
+          Jc[6 * row + 1] = Gr[0] * p[2] - Gr[2] * p[0];
+          Jc[6 * row + 2] = Gr[1] * p[0] - Gr[0] * p[1];
+          copy(Gr, Gr + 3, Jc + 6 * row + 3);
+          // Board point: dq / dX = R
+          for (int c{0}; c < 3; ++c)
+            Jp[3 * row + c] =
+                Gr[0] * R[c] + Gr[1] * R[3 + c] + Gr[2] * R[6 + c];
+        }
+
+        for (int a{0}; a < 6; ++a) {
+          double const c0 = Jc[a], c1 = Jc[6 + a];
+          for (int b{0}; b < 6; ++b)
+            sys.V[6 * a + b] += c0 * Jc[b] + c1 * Jc[6 + b];
+          sys.g[a] += c0 * r[0] + c1 * r[1];
+          double *Wa = sys.W.data() + a * nc;
+          for (int k{0}; k < 9; ++k)
+            if (intrinsicCol[k] >= 0)
+              Wa[intrinsicCol[k]] += c0 * Ja[k] + c1 * Ja[9 + k];
+          for (int c{0}; c < 3; ++c)
+            if (pointCol[3 * j + c] >= 0)
+              Wa[pointCol[3 * j + c]] += c0 * Jp[c] + c1 * Jp[3 + c];
+        }
+
+        int const *pc = freeIndex_.data() + 9 + 3 * id;
+        for (int k{0}; k < 9; ++k) {
+          int const ik = freeIndex_[k];
+          if (ik < 0)
+            continue;
+          for (int l{0}; l < 9; ++l) {
+            int const il = freeIndex_[l];
+            if (il >= 0)
+              Uc[ik * n + il] += Ja[k] * Ja[l] + Ja[9 + k] * Ja[9 + l];
+          }
+          for (int c{0}; c < 3; ++c) {
+            if (pc[c] < 0)
+              continue;
+            double const s = Ja[k] * Jp[c] + Ja[9 + k] * Jp[3 + c];
+            Uc[ik * n + pc[c]] += s;
+            Uc[pc[c] * n + ik] += s;
+          }
+          gc[ik] += Ja[k] * r[0] + Ja[9 + k] * r[1];
+        }
+        for (int c{0}; c < 3; ++c) {
+          if (pc[c] < 0)
+            continue;
+          for (int d{0}; d < 3; ++d)
+            if (pc[d] >= 0)
+              Uc[pc[c] * n + pc[d]] += Jp[c] * Jp[d] + Jp[3 + c] * Jp[3 + d];
+          gc[pc[c]] += Jp[c] * r[0] + Jp[3 + c] * r[1];
+        }
+      }
+    }
+  });
+
+  U.assign(n * n, 0);
+  g.assign(n, 0);
+  for (int chunk{0}; chunk < nChunks; ++chunk) {
+    for (int k{0}; k < n * n; ++k)
+      U[k] += chunkU[chunk][k];
+    for (int k{0}; k < n; ++k)
+      g[k] += chunkG[chunk][k];
+  }
+}
+
+/** Eliminate the poses from the normal equations damped by lambda:
+ * S = U - W^T V^-1 W and rhs = -g + W^T V^-1 gc, keeping V^-1 of every frame
+ * for the back substitution.
+ */
+bool SparseROSolver::reducedSystem(vector<double> const &U,
+                                   vector<double> const &g,
+                                   double const lambda, vector<double> &S,
+                                   vector<double> &rhs) {
+  int const n = nFree_;
+  int const nFrames = int(frames_.size());
+  int const nChunks = std::min(nJobs_, std::max(1, nFrames));
+  vector<vector<double>> chunkS(nChunks, vector<double>(n * n, 0));
+  vector<vector<double>> chunkRhs(nChunks, vector<double>(n, 0));
+  vector<char> chunkOk(nChunks, 1);
+
+  parallelForEach(nChunks, nJobs_, [&](int const chunk) {
+    double *Sc = chunkS[chunk].data();
+    double *rc = chunkRhs[chunk].data();
+    for (int i{chunk * nFrames / nChunks}; i < (chunk + 1) * nFrames / nChunks;
+         ++i) {
+      auto &sys = systems_[i];
+      int const nc = int(sys.cols.size());
+      array<double, 36> L = sys.V;
+      for (int a{0}; a < 6; ++a)
+        L[7 * a] *= 1 + lambda;
+      if (!cholesky(L.data(), 6)) {
+        chunkOk[chunk] = 0;
+        return;
+      }
+      for (int a{0}; a < 6; ++a) {
+        array<double, 6> e{};
+        e[a] = 1;
+        choleskySolve(L.data(), 6, e.data());
+        for (int b{0}; b < 6; ++b)
+          sys.Vinv[6 * b + a] = e[b];
+      }
+
+      // Y = V^-1 W, z = V^-1 gc
+      vector<double> Y(6 * nc, 0);
+      array<double, 6> z{};
+      for (int a{0}; a < 6; ++a) {
+        for (int b{0}; b < 6; ++b) {
+          double const m = sys.Vinv[6 * a + b];
+          double const *Wb = sys.W.data() + b * nc;
+          double *Ya = Y.data() + a * nc;
+          for (int k{0}; k < nc; ++k)
+            Ya[k] += m * Wb[k];
+          z[a] += m * sys.g[b];
+        }
+      }
+      // cols is increasing, so l >= k only fills the upper triangle of S
+      for (int k{0}; k < nc; ++k) {
+        double *Sk = Sc + sys.cols[k] * n;
+        for (int a{0}; a < 6; ++a) {
+          double const w = sys.W[a * nc + k];
+          if (w == 0)
+            continue;
+          double const *Ya = Y.data() + a * nc;
+          for (int l{k}; l < nc; ++l)
+            Sk[sys.cols[l]] -= w * Ya[l];
+          rc[sys.cols[k]] += w * z[a];
+        }
+      }
+    }
+  });
+  if (find(chunkOk.begin(), chunkOk.end(), 0) != chunkOk.end())
+    return false;
+
+  S = U;
+  rhs.assign(n, 0);
+  for (int k{0}; k < n; ++k)
+    rhs[k] = -g[k];
+  for (int chunk{0}; chunk < nChunks; ++chunk) {
+    for (int k{0}; k < n; ++k)
+      for (int l{k}; l < n; ++l)
+        S[k * n + l] += chunkS[chunk][k * n + l];
+    for (int k{0}; k < n; ++k)
+      rhs[k] += chunkRhs[chunk][k];
+  }
+  for (int k{0}; k < n; ++k) {
+    for (int l{k + 1}; l < n; ++l)
+      S[l * n + k] = S[k * n + l];
+    S[k * n + k] += lambda * U[k * n + k];
+  }
+  return true;
+}
+
+/** Solve the damped normal equations for one Levenberg-Marquardt step by
+ * eliminating the poses: S ds = rhs, then dc = V^-1 (-gc - W ds) for every
+ * frame.
+ */
+bool SparseROSolver::solveDamped(vector<double> const &U,
+                                 vector<double> const &g, double const lambda,
+                                 vector<double> &deltaShared,
+                                 vector<array<double, 6>> &deltaPoses) {
+  vector<double> S;
+  if (!reducedSystem(U, g, lambda, S, deltaShared) ||
+      !cholesky(S.data(), nFree_))
+    return false;
+  choleskySolve(S.data(), nFree_, deltaShared.data());
+
+  int const nFrames = int(frames_.size());
+  deltaPoses.resize(nFrames);
+  parallelForEach(nFrames, nJobs_, [&](int const i) {
+    auto const &sys = systems_[i];
+    int const nc = int(sys.cols.size());
+    array<double, 6> b;
+    for (int a{0}; a < 6; ++a) {
+      b[a] = -sys.g[a];
+      for (int k{0}; k < nc; ++k)
+        b[a] -= sys.W[a * nc + k] * deltaShared[sys.cols[k]];
+    }
+    for (int a{0}; a < 6; ++a) {
+      deltaPoses[i][a] = 0;
+      for (int c{0}; c < 6; ++c)
+        deltaPoses[i][a] += sys.Vinv[6 * a + c] * b[c];
+    }
+  });
+  return true;
+}
+
+/** The covariance of the free shared parameters is sigma^2 S^-1, with S the
+ * undamped reduced system, so eliminating the poses also marginalises them.
+ */
+void SparseROSolver::estimateStdDevs(double const cost, size_t const nPoints) {
+  intrinsicStdDevs_.fill(0);
+  int const dof = 2 * int(nPoints) - nFree_ - 6 * int(frames_.size());
+  vector<double> U, g, S, rhs;
+  buildNormalEquations(U, g);
+  if (dof <= 0 || !reducedSystem(U, g, 0, S, rhs) ||
+      !cholesky(S.data(), nFree_)) {
+    for (int k{0}; k < 9; ++k)
+      if (freeIndex_[k] >= 0)
+        intrinsicStdDevs_[k] = numeric_limits<double>::quiet_NaN();
+    return;
+  }
+  double const sigma2 = cost / dof;
+  for (int k{0}; k < 9; ++k) {
+    int const f = freeIndex_[k];
+    if (f < 0)
+      continue;
+    vector<double> e(nFree_, 0);
+    e[f] = 1;
+    choleskySolve(S.data(), nFree_, e.data());
+    intrinsicStdDevs_[k] = sqrt(sigma2 * e[f]);
+  }
+}
+
+double SparseROSolver::solve(int const maxIterations) {
+  CV_Assert(!frames_.empty());
+  findFreeParameters();
+  size_t nPoints{0};
+  for (auto const &frame : frames_)
+    nPoints += frame.pointIds.size();
+
+  double currentCost = cost(intrinsics_, points_, frames_);
+  double lambda{1e-3};
+  vector<double> U, g, deltaShared;
+  vector<array<double, 6>> deltaPoses;
+  for (iterations_ = 0; iterations_ < maxIterations; ++iterations_) {
+    buildNormalEquations(U, g);
+    bool improved{false};
+    double newCost{currentCost};
+    while (lambda < 1e10) {
+      if (solveDamped(U, g, lambda, deltaShared, deltaPoses)) {
+        Intrinsics intrinsics = intrinsics_;
+        for (int k{0}; k < 9; ++k)
+          if (freeIndex_[k] >= 0)
+            intrinsics[k] += deltaShared[freeIndex_[k]];
+        auto points = points_;
+        for (size_t id{0}; id < points.size(); ++id) {
+          for (int c{0}; c < 3; ++c) {
+            int const f = freeIndex_[9 + 3 * id + c];
+            if (f >= 0)
+              points[id][c] += deltaShared[f];
+          }
+        }
+        auto frames = frames_;
+        for (size_t i{0}; i < frames.size(); ++i) {
+          auto const &d = deltaPoses[i];
+          frames[i].R =
+              multiply(rotationFromRodrigues(d[0], d[1], d[2]), frames[i].R);
+          for (int c{0}; c < 3; ++c)
+            frames[i].t[c] += d[3 + c];
+        }
+        newCost = cost(intrinsics, points, frames);
+        if (newCost < currentCost) {
+          intrinsics_ = intrinsics;
+          points_ = move(points);
+          frames_ = move(frames);
+          lambda = std::max(lambda / 10, 1e-12);
+          improved = true;
+          break;
+        }
+      }
+      lambda *= 10;
+    }
+    if (!improved)
+      break;
+    double const decrease = currentCost - newCost;
+    currentCost = newCost;
+    if (decrease <= 1e-12 * currentCost)
+      break;
+  }
+  estimateStdDevs(currentCost, nPoints);
+  return sqrt(currentCost / double(nPoints));
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <opencv2/core.hpp>
+#include <vector>
+
+/** Release-object calibration that exploits the sparsity of the problem.
+ *
+ * The unknowns are the shared intrinsics (fx, fy, cx, cy, k1, k2, p1, p2, k3),
+ * the shared board points and one pose per frame. Every observation only
+ * touches the intrinsics, one board point and one pose, so the per-frame poses
+ * are eliminated with a Schur complement in each Levenberg-Marquardt step and
+ * only the reduced system over intrinsics and board points is factorised.
+ * Building the normal equations is split over frames and runs on nJobs
+ * threads, which keeps the cost close to linear in the number of frames.
+ *
+ * The board point coordinates listed as fixed do not move. calibrateCameraRO()
+ * fixes all of the first point and point iFix, and z of the last point, which
+ * removes the scale and pose ambiguity between the board and the cameras and
+ * nothing more. Fixed parameters are left out of the
+ * reduced system, so with every board point fixed only the intrinsics are
+ * factorised.
+ *
+ * Frames can be added between calls to solve(), which then continues from the
+ * previous solution.
+ */
+class SparseROSolver {
+public:
+  /** fx, fy, cx, cy, k1, k2, p1, p2, k3 */
+  using Intrinsics = std::array<double, 9>;
+
+  /** Supports CALIB_FIX_PRINCIPAL_POINT and CALIB_ZERO_TANGENT_DIST.
+   * fixedCoordinates holds 3 * pointId + axis (0, 1, 2 for x, y, z) of each
+   * board point coordinate that should not move.
+   */
+  SparseROSolver(Intrinsics const &intrinsics,
+                 std::vector<cv::Point3f> const &boardPoints,
+                 std::vector<int> const &fixedCoordinates, int const flags,
+                 int const nJobs);
+
+  /** Add a frame seen at the initial pose rvec, tvec (board to camera).
+   * pointIds index the board points.
+   */
+  void addFrame(std::vector<int> const &pointIds,
+                std::vector<cv::Point2f> const &imagePoints,
+                cv::Vec3d const &rvec, cv::Vec3d const &tvec);
+
+  /** Run Levenberg-Marquardt from the current estimate.
+   * Returns the RMS reprojection error, like calibrateCameraRO().
+   */
+  double solve(int const maxIterations = 100);
+
+  Intrinsics const &intrinsics() const { return intrinsics_; }
+  /** One standard deviation of each intrinsic at the last solution, from the
+   * inverse of the normal equations scaled by the residual variance. Zero for
+   * fixed intrinsics, NaN if the frames don't constrain them yet.
+   */
+  Intrinsics const &intrinsicStdDevs() const { return intrinsicStdDevs_; }
+  std::vector<cv::Point3f> boardPoints() const;
+  int frames() const { return int(frames_.size()); }
+  int iterations() const { return iterations_; }
+
+private:
+  struct Frame {
+    std::vector<int> pointIds;
+    std::vector<cv::Point2f> imagePoints;
+    std::array<double, 9> R; // Row-major board to camera rotation
+    std::array<double, 3> t;
+  };
+
+  /** Per-frame blocks of the normal equations */
+  struct FrameSystem {
+    std::array<double, 36> V;    // Pose x pose
+    std::array<double, 6> g;     // Pose gradient
+    std::vector<int> cols;       // Free shared parameters coupled to the pose
+    std::vector<double> W;       // 6 x cols.size(), pose x free shared
+    std::array<double, 36> Vinv; // Inverse of the damped V
+  };
+
+  int nShared() const { return 9 + 3 * int(points_.size()); }
+  void findFreeParameters();
+  double cost(Intrinsics const &intrinsics,
+              std::vector<std::array<double, 3>> const &points,
+              std::vector<Frame> const &frames) const;
+  void buildNormalEquations(std::vector<double> &U, std::vector<double> &g);
+  bool reducedSystem(std::vector<double> const &U, std::vector<double> const &g,
+                     double const lambda, std::vector<double> &S,
+                     std::vector<double> &rhs);
+  bool solveDamped(std::vector<double> const &U, std::vector<double> const &g,
+                   double const lambda, std::vector<double> &deltaShared,
+                   std::vector<std::array<double, 6>> &deltaPoses);
+  void estimateStdDevs(double const cost, size_t const nPoints);
+
+  Intrinsics intrinsics_;
+  std::vector<std::array<double, 3>> points_;
+  std::vector<Frame> frames_;
+  std::vector<FrameSystem> systems_;
+  std::vector<char> fixed_;    // One per shared parameter
+  std::vector<int> freeIndex_; // Index in the reduced system, or -1 if fixed
+  int nFree_{0};
+  Intrinsics intrinsicStdDevs_{};
+  int nJobs_;
+  int iterations_{0};
+};
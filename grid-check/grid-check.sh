@@ -1,32 +1,160 @@
 #!/usr/bin/env bash
 
+# Finds the hundreds of markers in grid-red-2000.png (or disk-grid-2000.png with --disk),
+# and shows them in OpenScad on top of the grid they were rendered from.
+#
+# With --benchmark, runs hpm RUNS times (default 5) instead, and prints
+# markers per second and whether the found positions match the reference.
+# Writes tmp/benchmark-<image>.json.
+# Each found marker is matched with its nearest reference marker, so the order hpm finds them in doesn't matter.
+# Exits with an error if a marker is missing, extra, or further than MAX_POSITION_CHANGE_MM
+# from its reference marker, or if the reference file is missing.
+#
+# By default, the reference is an earlier hpm output, reference/<image>.hpm.positions,
+# and MAX_POSITION_CHANGE_MM defaults to 1e-6, so any change in what hpm finds fails.
+# Store the output of a known good hpm build as that reference with
+# ./grid-check.sh --benchmark --update-reference
+#
+# Add --accuracy to compare with the positions the grid was rendered at instead,
+# reference/<image>.rendered.positions, with MAX_POSITION_CHANGE_MM defaulting to 2.0.
+#
+# --benchmark doesn't rebuild hpm, so it measures the binary you have. Build it first.
+
 set -o errexit
 set -o pipefail
 
 readonly THISPATH="$(dirname "$0")"
 readonly HPMPATH="${THISPATH}/../hpm"
 readonly TMPDIR="${THISPATH}/tmp"
+readonly REFERENCEDIR="${THISPATH}/reference"
+mkdir -p "${TMPDIR}/"
 
-# Rebuild hpm binary
-pushd "${HPMPATH}"
-b
-popd
+DISK=""
+BENCHMARK=""
+ACCURACY=""
+UPDATE_REFERENCE=""
+for ARG in "$@"; do
+	case "${ARG}" in
+	--disk) DISK=true ;;
+	--benchmark) BENCHMARK=true ;;
+	--accuracy) ACCURACY=true ;;
+	--update-reference) UPDATE_REFERENCE=true ;;
+	*)
+		echo "Unknown option ${ARG}"
+		exit 1
+		;;
+	esac
+done
+if [ ${ACCURACY} ] && [ ${UPDATE_REFERENCE} ]; then
+	echo "The rendered positions don't change. Use --update-reference without --accuracy."
+	exit 1
+fi
+
+if [ ! ${BENCHMARK} ]; then
+	# Rebuild hpm binary
+	pushd "${HPMPATH}"
+	b
+	popd
+fi
 
 # Run hpm
-COMMAND="${HPMPATH}/hpm/hpm ${THISPATH}/openscadHandCodedCamParamsSixtupled.xml ${THISPATH}/grid-check-marker-params.xml ${THISPATH}/grid-red-2000.png --no-fit-by-distance"
+IMAGE="grid-red-2000.png"
+COMMAND="${HPMPATH}/hpm/hpm ${THISPATH}/openscadHandCodedCamParamsSixtupled.xml ${THISPATH}/grid-check-marker-params.xml ${THISPATH}/${IMAGE} --no-fit-by-distance"
 SCADSRC="${THISPATH}/sphere-grid.scad"
 SCADOBJ="geodesic_sphere(d=32)"
-if [[ "$1" == "--disk" ]]; then
-	COMMAND="${HPMPATH}/hpm/hpm ${THISPATH}/openscadHandCodedCamParamsSixtupled.xml ${THISPATH}/grid-check-disk-params.xml ${THISPATH}/disk-grid-2000.png --no-fit-by-distance"
+if [ ${DISK} ]; then
+	IMAGE="disk-grid-2000.png"
+	COMMAND="${HPMPATH}/hpm/hpm ${THISPATH}/openscadHandCodedCamParamsSixtupled.xml ${THISPATH}/grid-check-disk-params.xml ${THISPATH}/${IMAGE} --no-fit-by-distance"
 	SCADSRC="${THISPATH}/disk-grid.scad"
 	SCADOBJ="cylinder(d=70, h=0.01)"
 else
 	cp "${HPMPATH}/hpm/test-images/geodesic_sphere.scad" "${TMPDIR}/"
 fi
+
+if [ ${BENCHMARK} ]; then
+	readonly RUNS="${RUNS:-5}"
+	if [ ${ACCURACY} ]; then
+		readonly MAX_POSITION_CHANGE_MM="${MAX_POSITION_CHANGE_MM:-2.0}"
+		readonly REFERENCE="${REFERENCEDIR}/${IMAGE}.rendered.positions"
+	else
+		readonly MAX_POSITION_CHANGE_MM="${MAX_POSITION_CHANGE_MM:-1e-6}"
+		readonly REFERENCE="${REFERENCEDIR}/${IMAGE}.hpm.positions"
+	fi
+	readonly POSITIONSFILE="${TMPDIR}/${IMAGE}.positions"
+	readonly TIMESFILE="${TMPDIR}/${IMAGE}.times"
+	: >"${TIMESFILE}"
+	for ((RUN = 1; RUN <= RUNS; RUN++)); do
+		START_NS=$(date +%s%N)
+		${COMMAND} | tail -n +2 >"${POSITIONSFILE}"
+		echo "$((($(date +%s%N) - START_NS) / 1000))e-6" >>"${TIMESFILE}"
+	done
+	if [ ${UPDATE_REFERENCE} ]; then
+		mkdir -p "${REFERENCEDIR}/"
+		cp "${POSITIONSFILE}" "${REFERENCE}"
+		echo "Stored the positions as the new reference ${REFERENCE}"
+	elif [ ! -f "${REFERENCE}" ]; then
+		echo "Missing reference ${REFERENCE}. Store the output of a known good hpm build with --benchmark --update-reference."
+		exit 1
+	fi
+
+	python3 - "${POSITIONSFILE}" "${REFERENCE}" "${TIMESFILE}" "${TMPDIR}/benchmark-${IMAGE}.json" <<EOP
+import json
+import re
+import sys
+
+
+def read_positions(filename):
+    number = r"-?\d+(?:\.\d+)?(?:[eE][-+]?\d+)?"
+    with open(filename) as f:
+        return [[float(n) for n in re.findall(number, line)] for line in f if line.strip()]
+
+
+def distance(a, b):
+    return sum((x - y) ** 2 for x, y in zip(a, b)) ** 0.5
+
+
+def nearest_distances(points, others):
+    return [min(distance(p, o) for o in others) if others else float("inf") for p in points]
+
+
+positions = read_positions(sys.argv[1])
+reference = read_positions(sys.argv[2])
+with open(sys.argv[3]) as f:
+    times = sorted(float(line) for line in f)
+median_s = times[len(times) // 2]
+
+# Matching both ways catches missing markers, extra markers,
+# and two found markers landing on the same reference marker
+found_to_reference = nearest_distances(positions, reference)
+reference_to_found = nearest_distances(reference, positions)
+same_count = len(positions) == len(reference)
+max_change_mm = max(found_to_reference + reference_to_found, default=0.0)
+passed = same_count and max_change_mm <= ${MAX_POSITION_CHANGE_MM}
+
+report = {
+    "markers": len(positions),
+    "reference_markers": len(reference),
+    "runs": len(times),
+    "median_s": median_s,
+    "min_s": times[0],
+    "markers_per_s": len(positions) / median_s,
+    "max_position_change_mm": max_change_mm,
+    "passed": passed,
+}
+with open(sys.argv[4], "w") as f:
+    json.dump(report, f, indent=2)
+print(json.dumps(report, indent=2))
+if not passed:
+    print("FAIL: positions differ from the reference " + sys.argv[2])
+sys.exit(0 if passed else 1)
+EOP
+	echo "PASS"
+	exit 0
+fi
+
 readonly POSITIONS=$(${COMMAND} | tail -n +2)
 
 # Build OpenScad source file, including the hpm results
-mkdir -p "${TMPDIR}/"
 readonly TMPFILE=$(mktemp -p "${TMPDIR}/" XXXXXXXXXX.scad)
 cp "${SCADSRC}" "${TMPFILE}"
 cat <<EOF >>"${TMPFILE}"
@@ -0,0 +1,47 @@
+# Shared by use_ssh_continous.sh and get_auto_calibration_data_automatically.sh.
+# Source it, don't run it:
+#
+# source "${THISPATH}/common.sh"
+#
+# Messages go to /dev/fd/3, which the sourcing script points at the terminal,
+# while everything else goes to its log file.
+
+readonly RASPISTILL="/home/pi/repos/NativePiCamera/bin/raspistill_CS_lens"
+
+# Fill FAKE_IMAGES with the images in directory $1, in name order,
+# or exit if there are none.
+find_fake_images() {
+	local -r DIRECTORY=$1
+	mapfile -t FAKE_IMAGES < <(find "${DIRECTORY}" -maxdepth 1 -type f \( -name '*.jpg' -o -name '*.bmp' -o -name '*.png' \) | sort)
+	if [ ${#FAKE_IMAGES[@]} -eq 0 ]; then
+		echo "No images to replay in ${DIRECTORY}" | tee /dev/fd/3
+		exit 1
+	fi
+}
+
+# Take a picture on the pi with shutter time $2 and encoding $3 (jpg or bmp), and save it as $1.
+# raspistill writes the image to stdout, which ssh hands us directly.
+# Nothing touches the pi's SD card, and there's no scp round trip.
+# SSH_PID holds ssh's PID while it runs, so that cleanup can wait for it.
+# Returns ssh's exit status.
+capture_from_pi() {
+	local -r IMAGE=$1
+	local -r SHUTTER=$2
+	local -r ENCODING=$3
+	local PI_CMD="sudo python3 /home/pi/repos/rpi_ws281x/python/examples/tobben_constant_light.py > /dev/null"
+	PI_CMD+=" && ${RASPISTILL} --quality 100 --timeout 300 --shutter ${SHUTTER} --ISO 50 --encoding ${ENCODING} -o - --width 3280 --height 2464"
+	PI_CMD+=" && sudo python3 /home/pi/repos/rpi_ws281x/python/examples/lights_off.py > /dev/null"
+	ssh pi@rpi "${PI_CMD}" >"${IMAGE}" 2> >(tee /dev/fd/3) &
+	SSH_PID=$!
+	wait ${SSH_PID}
+	local -r STATUS=$?
+	SSH_PID=0
+	return ${STATUS}
+}
+
+# Log that hpm took $1 ms on image $2.
+# Every image pays for hpm startup and params parsing. The log shows how much
+# that costs, to compare with a persistent hpm when that exists.
+log_hpm_latency() {
+	echo "hpm took $1 ms on $2"
+}
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+"""A stand-in for the Duet's /machine/code/ http endpoint.
+   Lets get_auto_calibration_data_automatically.sh run, and be timed, without a Hangprinter.
+   Use for example like
+   $ ./fake_duet.py --port 8080 --move-time 1.0
+
+   Understands the gcodes that script sends:
+   M98 P"/macros/Torque_mode" A<a> B<b> C<c> D<d> : Start moving the motors towards a position given by the torques.
+   M569.3 P... S                                   : Set the encoder reference point.
+   M569.3 P...                                     : Reply with the encoder positions, like [1.00, 2.00, 3.00, 4.00],
+   Anything else gets an empty reply.
+
+"""
+
+import argparse
+import http.server
+import re
+import threading
+import time
+
+
+class Motors:
+    """Motors that move linearly from where they are to a target, in move_time seconds."""
+
+    def __init__(self, move_time):
+        self.move_time = move_time
+        self.lock = threading.Lock()
+        self.start = [0.0, 0.0, 0.0, 0.0]
+        self.target = [0.0, 0.0, 0.0, 0.0]
+        self.start_time = time.monotonic()
+        self.reference = [0.0, 0.0, 0.0, 0.0]
+
+    def position(self):
+        fraction = 1.0
+        if self.move_time > 0:
+            fraction = min(1.0, (time.monotonic() - self.start_time) / self.move_time)
+        return [s + fraction * (t - s) for s, t in zip(self.start, self.target)]
+
+    def move_to(self, target):
+        with self.lock:
+            self.start = self.position()
+            self.target = target
+            self.start_time = time.monotonic()
+
+    def set_reference(self):
+        with self.lock:
+            self.reference = self.position()
+
+    def encoders(self):
+        with self.lock:
+            return [p - r for p, r in zip(self.position(), self.reference)]
+
+
+def reply(motors, gcode):
+    if gcode.startswith("M98") and "Torque_mode" in gcode:
+        torques = [float(re.search(axis + r"(-?[\d.]+)", gcode).group(1)) for axis in "ABCD"]
+        # Any repeatable mapping from torques to positions will do
+        motors.move_to([1000.0 * t - 50.0 for t in torques])
+        return ""
+    if gcode.startswith("M569.3"):
+        if gcode.rstrip().endswith("S"):
+            motors.set_reference()
+            return ""
+        return "[" + ", ".join("{:.2f}".format(e) for e in motors.encoders()) + "],\n"
+    return ""
+
+
+def make_handler(motors, verbose):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_POST(self):
+            length = int(self.headers.get("Content-Length", 0))
+            gcode = self.rfile.read(length).decode()
+            body = reply(motors, gcode).encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *args):
+            if verbose:
+                super().log_message(format, *args)
+
+    return Handler
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Fake Duet http endpoint for testing without a Hangprinter.")
+    parser.add_argument("--port", type=int, default=8080, help="Port to listen on")
+    parser.add_argument("--move-time", type=float, default=1.0, help="Seconds the motors take to reach a new position")
+    parser.add_argument("--verbose", action="store_true", help="Log every request")
+    args = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer(
+        ("localhost", args.port), make_handler(Motors(args.move_time), args.verbose)
+    )
+    print("Fake Duet listening on http://localhost:{}/machine/code/".format(args.port))
+    server.serve_forever()
@@ -3,6 +3,11 @@
 # This script tries to move the Hangprinter around and collect auto calibration data.
 # It sends gcodes to the Hangprinter, and collects images from Raspberry pi.
 # It then runs hpm locally on the image.
+# hpm overlaps the next move: it analyses each image in the background while the Hangprinter moves to, and we capture, the next one.
+# The gcodes, the encoder reads and the captures themselves still run one after the other.
+# At most MAX_HPM_JOBS hpm processes run at once, one per CPU core by default.
+# Once that many run, the next sample waits for the oldest of them.
+# What hpm writes to standard error is logged, and kept in images/<something>/<sample>.err.
 
 # WARNING! Before you run this command, it is assumet that you have put your effector
 # in the home position, with the nozzle at the origin, and with all lines non-slack.
@@ -13,6 +18,7 @@
 # $get_auto_calibration_data_automatically.sh --show result
 #
 # ... whill stop to show result during each invocation of hpm.
+# With --show, hpm runs in the foreground instead, so the next move waits until you've closed hpm's windows.
 
 # Your will get images saved into a subdirectory ./images/<something>
 # You will also get a log file called ./logs/<something>.log
@@ -22,20 +28,32 @@
 
 # Copy/paste friendly, filtered versions of the data strings will be printed out at the end.
 
+# To test and time the whole pipeline without a Hangprinter or a pi, run
+#
+# $ python3 fake_duet.py &
+# $ GCODE_ENDPOINT=http://localhost:8080/machine/code/ FAKE_CAMERA=images/<earlier-series> ./get_auto_calibration_data_automatically.sh
+#
+# FAKE_CAMERA replays the images of an earlier series, starting over if there are fewer images than samples.
+
 # Stop the program with ctrl-C, or by waiting until it finishes by itself
 
 set -o pipefail
 
-readonly GCODE_ENDPOINT="http://duet3.local/machine/code/"
+readonly GCODE_ENDPOINT="${GCODE_ENDPOINT:-http://duet3.local/machine/code/}"
+readonly MAX_HPM_JOBS="${MAX_HPM_JOBS:-$(nproc)}"
 
 SSH_PID=0
-readonly SSH_PIPE="/tmp/ssh-input-for-pi"
+HPM_PIDS=()
 
 XYZ_OF_SAMP=""
 XYZ_OF_SAMPS=""
 MOTOR_POS_SAMP=""
 MOTOR_POS_SAMPS=""
 
+# Outputs of the background hpm runs, and the motor positions, one file per sample
+SAMPLES="$(mktemp -d)"
+readonly SAMPLES
+
 cleanup() {
 	if [ ${VERBOSE} ]; then
 		echo "Running cleanup" 2>&1 | tee /dev/fd/3
@@ -43,9 +61,32 @@ cleanup() {
 	if [ ${SSH_PID} -ne 0 ]; then
 		echo "Waiting for ssh" 2>&1 | tee /dev/fd/3
 		wait ${SSH_PID}
-		rm -f ${SSH_PIPE}
+	fi
+	if [ ${#HPM_PIDS[@]} -ne 0 ]; then
+		echo "Waiting for hpm" 2>&1 | tee /dev/fd/3
+		wait "${HPM_PIDS[@]}"
 	fi
 
+	# Filter the samples in the order they were taken
+	for MOTOR_POS_FILE in "${SAMPLES}"/*.motor_pos; do
+		if [ ! -f "${MOTOR_POS_FILE}" ]; then
+			continue
+		fi
+		MOTOR_POS_SAMP="$(cat "${MOTOR_POS_FILE}")"
+		XYZ_OF_SAMP="$(cat "${MOTOR_POS_FILE%.motor_pos}.xyz" 2>/dev/null)"
+		HPM_ERRORS="$(cat "${MOTOR_POS_FILE%.motor_pos}.err" 2>/dev/null)"
+		if ! [[ "${XYZ_OF_SAMP}" =~ .*Warning.* ]] && ! [[ "${HPM_ERRORS}" =~ .*Warning.* ]]; then
+			if [ -n "${XYZ_OF_SAMP}" ] && [ "${XYZ_OF_SAMP}" != "Could not identify markers" ]; then
+				MOTOR_POS_SAMPS+="${MOTOR_POS_SAMP}
+"
+				XYZ_OF_SAMP_WITH_COMMA_NEWLINE="${XYZ_OF_SAMP%?},
+"
+				XYZ_OF_SAMPS+=${XYZ_OF_SAMP_WITH_COMMA_NEWLINE}
+			fi
+		fi
+	done
+	rm -rf "${SAMPLES}"
+
 	echo "" | tee /dev/fd/3
 	echo "" | tee /dev/fd/3
 	echo "xyz_of_samp = np.array([" | tee /dev/fd/3
@@ -63,14 +104,12 @@ trap cleanup SIGINT SIGTERM
 
 readonly THISPATH="$(dirname "$0")"
 readonly IMAGES="${THISPATH}/images"
-
-readonly USEPATH_ON_PI="/home/pi/repos/hp-mark/use"
+source "${THISPATH}/common.sh"
 
 readonly HPM="../hpm/hpm/hpm"
 readonly CAMPARAMS="../hpm/hpm/example-cam-params/loDistCamParams2.xml"
 readonly MARKERPARAMS="../hpm/hpm/example-marker-params/my-marker-params.xml"
 
-readonly RASPISTILL="/home/pi/repos/NativePiCamera/bin/raspistill_CS_lens"
 readonly SHUTTER="15000" # In daylight
 #readonly SHUTTER="150000" # In low light
 SERIESNAME=$(mktemp --dry-run XXXXX)
@@ -84,7 +123,44 @@ exec 3>&1 1>>${LOGFILE} 2>&1
 readonly IMAGESERIES="${IMAGES}/${SERIESNAME}"
 mkdir -p "${IMAGESERIES}/"
 
-readonly IMAGESERIES_ON_PI="${USEPATH_ON_PI}/images/${SERIESNAME}"
+FAKE_IMAGES=()
+if [ ${FAKE_CAMERA} ]; then
+	find_fake_images "${FAKE_CAMERA}"
+fi
+readonly FAKE_IMAGES
+
+# hpm waits for a key press when it shows something, so don't leave it in the background
+HPM_IN_FOREGROUND=""
+for ARG in "$@"; do
+	if [ "${ARG}" == "--show" ]; then
+		HPM_IN_FOREGROUND=true
+	fi
+done
+readonly HPM_IN_FOREGROUND
+
+# Run hpm on image $2 of sample $1.
+# The result ends up in ${SAMPLES}/$1.xyz, and is printed when it's ready.
+# hpm's error output ends up in ${SAMPLES}/$1.err, and next to the image, unless there is none.
+analyse() {
+	local -r SAMPLE=$1
+	local -r IMAGE=$2
+	shift
+	shift
+	local -r COMMAND="${HPM} ${CAMPARAMS} ${MARKERPARAMS} ${IMAGE} --try-hard $@"
+	if [ ${VERBOSE} ]; then
+		echo "${COMMAND}" 2>&1 | tee /dev/fd/3
+	fi
+	local -r HPM_START_NS=$(date +%s%N)
+	local -r XYZ="$($COMMAND 2>"${SAMPLES}/${SAMPLE}.err")"
+	local -r HPM_MS=$((($(date +%s%N) - HPM_START_NS) / 1000000))
+	echo "${XYZ}" >"${SAMPLES}/${SAMPLE}.xyz"
+	echo "${SAMPLE} ${XYZ}" | tee /dev/fd/3
+	if [ -s "${SAMPLES}/${SAMPLE}.err" ]; then
+		tee /dev/fd/3 <"${SAMPLES}/${SAMPLE}.err"
+		cp "${SAMPLES}/${SAMPLE}.err" "${IMAGESERIES}/${SAMPLE}.err"
+	fi
+	log_hpm_latency ${HPM_MS} "${IMAGE}"
+}
 
 let "INC=1"
 COUNT=""
@@ -127,53 +203,33 @@ for SET_TORQUES in "M98 P\"/macros/Torque_mode\" A0.09 B0.09 C0.01 D0" \
 		sleep 0.5 # Let motors move
 		MOTOR_POS_SAMP2="$(curl --silent ${GCODE_ENDPOINT} -d "${READ_ENCODERS}" 2>&1 | tr -d '\n')"
 	done
-	echo -n ${MOTOR_POS_SAMP} | tee /dev/fd/3
-
-	IMAGE="${IMAGESERIES}/${COUNT}.jpg"
-	IMAGE_ON_PI="${IMAGESERIES_ON_PI}/${COUNT}.jpg"
-
-	rm -f ${SSH_PIPE}
-	mkfifo ${SSH_PIPE}
-	tail -f ${SSH_PIPE} | ssh pi@rpi RASPISTILL=${RASPISTILL} USEPATH_ON_PI=${USEPATH_ON_PI} IMAGE_ON_PI=${IMAGE_ON_PI} 'bash -s' 2>&1 | tee /dev/fd/3 &
-	SSH_PID=$!
-	PI_CMD="cd \"${USEPATH_ON_PI}\""
-	if [ ${VERBOSE} ]; then
-		PI_CMD+=" && pwd"
-	fi
-	PI_CMD+=" && mkdir -p \"${IMAGESERIES_ON_PI}/\""
-	PI_CMD+=" && sudo python3 /home/pi/repos/rpi_ws281x/python/examples/tobben_constant_light.py > /dev/null"
-	PI_CMD+=" && "${RASPISTILL}" --quality 100 --timeout 300 --shutter "${SHUTTER}" --ISO 50 -o \"${IMAGE_ON_PI}\" --width 3280 --height 2464"
-	PI_CMD+=" && sudo python3 /home/pi/repos/rpi_ws281x/python/examples/lights_off.py > /dev/null"
-	if [ ${VERBOSE} ]; then
-		PI_CMD+=" && echo Captured image remotely: \"${IMAGE_ON_PI}\""
-	fi
-	PI_CMD+="; exit"
-	echo ${PI_CMD} >>${SSH_PIPE}
-	wait ${SSH_PID}
-	SSH_PID=0
-
-	if [ ${VERBOSE} ]; then
-		echo "Copies home:" 2>&1 | tee /dev/fd/3
-		scp pi@rpi:${IMAGE_ON_PI} ${IMAGE} 2>&1 | tee /dev/fd/3
+	echo ${MOTOR_POS_SAMP} | tee /dev/fd/3
+	echo "${MOTOR_POS_SAMP}" >"${SAMPLES}/${COUNT}.motor_pos"
+
+	if [ ${FAKE_CAMERA} ]; then
+		FAKE_IMAGE="${FAKE_IMAGES[$(((INC - 1) % ${#FAKE_IMAGES[@]}))]}"
+		IMAGE="${IMAGESERIES}/${COUNT}.${FAKE_IMAGE##*.}"
+		cp "${FAKE_IMAGE}" "${IMAGE}"
+		if [ ${VERBOSE} ]; then
+			echo "Replayed ${FAKE_IMAGE}" 2>&1 | tee /dev/fd/3
+		fi
 	else
-		scp -q pi@rpi:${IMAGE_ON_PI} ${IMAGE} 2>&1 | tee /dev/fd/3
-	fi
-
-	COMMAND="${HPM} ${CAMPARAMS} ${MARKERPARAMS} ${IMAGE} --try-hard $@"
-	if [ ${VERBOSE} ]; then
-		echo "${COMMAND}" 2>&1 | tee /dev/fd/3
+		IMAGE="${IMAGESERIES}/${COUNT}.jpg"
+		capture_from_pi "${IMAGE}" ${SHUTTER} jpg
+		if [ ${VERBOSE} ]; then
+			echo "Captured image: ${IMAGE}" 2>&1 | tee /dev/fd/3
+		fi
 	fi
-	XYZ_OF_SAMP="$($COMMAND 2>&1)"
-	echo ${XYZ_OF_SAMP} | tee /dev/fd/3
 
-	if ! [[ "${XYZ_OF_SAMP}" =~ .*Warning.* ]]; then
-		if [ "${XYZ_OF_SAMP}" != "Could not identify markers" ]; then
-			MOTOR_POS_SAMPS+="${MOTOR_POS_SAMP}
-"
-			XYZ_OF_SAMP_WITH_COMMA_NEWLINE="${XYZ_OF_SAMP%?},
-"
-			XYZ_OF_SAMPS+=${XYZ_OF_SAMP_WITH_COMMA_NEWLINE}
+	if [ ${HPM_IN_FOREGROUND} ]; then
+		analyse "${COUNT}" "${IMAGE}" "$@"
+	else
+		if [ ${#HPM_PIDS[@]} -ge ${MAX_HPM_JOBS} ]; then
+			wait "${HPM_PIDS[0]}"
+			HPM_PIDS=("${HPM_PIDS[@]:1}")
 		fi
+		analyse "${COUNT}" "${IMAGE}" "$@" &
+		HPM_PIDS+=($!)
 	fi
 
 	let "INC=INC+1"
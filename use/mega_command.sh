@@ -1,18 +1,91 @@
-SERIES_NAME=$1
-HPM="../hpm/hpm/hpm ../hpm/hpm/example-cam-params/loDistCamParams2.xml ../hpm/hpm/example-marker-params/my-marker-params.xml ./images/"
-MAX_NUM=$2
+#!/usr/bin/env bash
+
+# Runs hpm on a recorded image series, like the ones
+# get_auto_calibration_data_automatically.sh saves:
+#
+# ./mega_command.sh <series-name> <number-of-images> [hpm options]
+#
+# Images are analysed on one hpm process per CPU core.
+# Set JOBS=1 to run them one by one, for example with hpm's --show option.
+#
+# Prints the hpm output of each image, in order, followed by a
+# copy/paste friendly xyz_of_samp array of the successful ones.
+# One tab separated line per image, <count> <ok|fail> <hpm output or reason>,
+# is also written to images/<series-name>/results.tsv, or RESULTS if set.
+# Only hpm's standard output goes into results.tsv.
+# What hpm writes to standard error is printed too, and kept in images/<series-name>/<count>.err.
+
+set -o pipefail
+
+readonly SERIES_NAME=$1
+readonly MAX_NUM=$2
 shift
 shift
 
-let "INC=1"
-PADDED_COUNT=""
-while [ ${INC} -le ${MAX_NUM} ]; do
-	printf -v PADDED_COUNT "%04d" ${INC}
-	echo -n "${PADDED_COUNT} "
-	${HPM}${SERIES_NAME}/${PADDED_COUNT}.jpg $@
-	let "INC=INC+1"
+readonly HPM="../hpm/hpm/hpm"
+readonly CAMPARAMS="../hpm/hpm/example-cam-params/loDistCamParams2.xml"
+readonly MARKERPARAMS="../hpm/hpm/example-marker-params/my-marker-params.xml"
+readonly SERIES="./images/${SERIES_NAME}"
+readonly JOBS="${JOBS:-$(nproc)}"
+readonly RESULTS="${RESULTS:-${SERIES}/results.tsv}"
+
+OUTPUTS="$(mktemp -d)"
+readonly OUTPUTS
+trap 'rm -rf "${OUTPUTS}"' EXIT
+
+# Run hpm on image number $1, and save its output in ${OUTPUTS}/$1,
+# and its error output in ${SERIES}/$1.err, unless there is none
+analyse() {
+	local -r COUNT=$1
+	shift
+	"${HPM}" "${CAMPARAMS}" "${MARKERPARAMS}" "${SERIES}/${COUNT}.jpg" "$@" >"${OUTPUTS}/${COUNT}" 2>"${SERIES}/${COUNT}.err"
+	echo $? >"${OUTPUTS}/${COUNT}.status"
+	if [ ! -s "${SERIES}/${COUNT}.err" ]; then
+		rm -f "${SERIES}/${COUNT}.err"
+	fi
+}
+export -f analyse
+export HPM CAMPARAMS MARKERPARAMS SERIES OUTPUTS
+
+seq -f "%04g" 1 "${MAX_NUM}" | xargs -P "${JOBS}" -I{} bash -c 'analyse "$@"' _ {} "$@"
+
+XYZ_OF_SAMPS=""
+: >"${RESULTS}"
+for COUNT in $(seq -f "%04g" 1 "${MAX_NUM}"); do
+	XYZ_OF_SAMP="$(cat "${OUTPUTS}/${COUNT}")"
+	ERRORS="$(cat "${SERIES}/${COUNT}.err" 2>/dev/null)"
+	echo "${COUNT} ${XYZ_OF_SAMP}"
+	if [ -n "${ERRORS}" ]; then
+		echo "${ERRORS}" >&2
+	fi
+
+	REASON=""
+	if [ ! -f "${SERIES}/${COUNT}.jpg" ]; then
+		REASON="No such image"
+	elif [[ "${XYZ_OF_SAMP}" =~ .*Warning.* ]] || [ "${XYZ_OF_SAMP}" == "Could not identify markers" ]; then
+		REASON="${XYZ_OF_SAMP}"
+	elif [[ "${ERRORS}" =~ .*Warning.* ]]; then
+		REASON="${ERRORS}"
+	elif [ "$(cat "${OUTPUTS}/${COUNT}.status")" -ne 0 ]; then
+		REASON="hpm exited with status $(cat "${OUTPUTS}/${COUNT}.status"), see ${SERIES}/${COUNT}.err: ${XYZ_OF_SAMP}"
+	fi
+
+	if [ -z "${REASON}" ]; then
+		printf "%s\tok\t%s\n" "${COUNT}" "$(echo ${XYZ_OF_SAMP})" >>"${RESULTS}"
+		XYZ_OF_SAMPS+="${XYZ_OF_SAMP%?},
+"
+	else
+		printf "%s\tfail\t%s\n" "${COUNT}" "$(echo ${REASON})" >>"${RESULTS}"
+	fi
 done
 
+echo ""
+echo "xyz_of_samp = np.array(["
+echo -n "${XYZ_OF_SAMPS}"
+echo "])"
+echo ""
+echo "Results written to ${RESULTS}"
+
 # SET 2
 # ${HPM}3YIsz/0003.jpg
 # ${HPM}3YIsz/0007.jpg
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+
+"""Summarises the per-sample metrics that use_ssh_continous.sh writes with METRICS=true.
+   Use for example like
+   $ ./metrics_summary.py logs/my-awesome-data-collection.metrics.jsonl logs/my-awesome-data-collection.metrics.json
+
+   Every line of the input is one sample, like
+   {"sample": "0001", "position_ms": 210, "capture_ms": 2400, "capture": "ok", "hpm_ms": 1800, "hpm": "no_markers"}
+   The output holds, for every stage, latency percentiles, a histogram, and how often each outcome happened.
+   It can be run while use_ssh_continous.sh is still collecting samples.
+
+"""
+
+import argparse
+import json
+import sys
+
+STAGES = ["position", "capture", "hpm"]
+BUCKET_EDGES_MS = [50, 100, 200, 500, 1000, 2000, 5000, 10000]
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))]
+
+
+def histogram(values):
+    labels = ["<{}ms".format(edge) for edge in BUCKET_EDGES_MS] + [">={}ms".format(BUCKET_EDGES_MS[-1])]
+    counts = dict.fromkeys(labels, 0)
+    for value in values:
+        index = next((i for i, edge in enumerate(BUCKET_EDGES_MS) if value < edge), len(BUCKET_EDGES_MS))
+        counts[labels[index]] += 1
+    return counts
+
+
+def summarise(samples):
+    summary = {"samples": len(samples), "stages": {}}
+    for stage in STAGES:
+        latencies = [s[stage + "_ms"] for s in samples if stage + "_ms" in s]
+        if not latencies:
+            continue
+        outcomes = {}
+        for s in samples:
+            if stage in s:
+                outcomes[s[stage]] = outcomes.get(s[stage], 0) + 1
+        summary["stages"][stage] = {
+            "count": len(latencies),
+            "mean_ms": sum(latencies) / len(latencies),
+            "p50_ms": percentile(latencies, 50),
+            "p90_ms": percentile(latencies, 90),
+            "p99_ms": percentile(latencies, 99),
+            "max_ms": max(latencies),
+            "histogram": histogram(latencies),
+            "outcomes": outcomes,
+        }
+    return summary
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Summarise use_ssh_continous.sh metrics.")
+    parser.add_argument("samples", help="The .metrics.jsonl file with one line per sample")
+    parser.add_argument("output", nargs="?", help="Write the summary to this JSON file, instead of stdout")
+    args = parser.parse_args()
+
+    with open(args.samples) as f:
+        samples = [json.loads(line) for line in f if line.strip()]
+    summary = summarise(samples)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(summary, f, indent=2)
+    else:
+        json.dump(summary, sys.stdout, indent=2)
+        print()
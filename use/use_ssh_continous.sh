@@ -2,9 +2,7 @@
 
 # For quick hpm usage from non-pi host
 #  - Ssh into the rpi4
-#  - Take an image
-#  - Exit ssh
-#  - Download the image
+#  - Take an image, and stream it back over the same ssh connection
 #  - Runs hpm on the image
 #
 # Doesn't compile hpm.
@@ -20,11 +18,25 @@
 # By default, <something> will be set to a random six character name.
 # If you want to set it explicitly do:
 # DATA_SERIES_NAME="my-awesome-data-collection" ./use_ssh_continous.ssh
+#
+# Images are JPEG encoded on the pi by default.
+# To skip the JPEG encode and decode, at the cost of ~24 MB per image over the network, say
+# ENCODING=bmp ./use_ssh_continous.sh
+#
+# To test without a pi, replay the images of an earlier series, like
+# FAKE_CAMERA=images/my-awesome-data-collection ./use_ssh_continous.sh
+# It stops when all images have been replayed.
+#
+# To find out which stage makes samples slow or fail, say
+# METRICS=true ./use_ssh_continous.sh
+# Every sample then adds a JSON line with the time spent getting the motor positions,
+# capturing and running hpm, and the outcome of each, to ./logs/<something>.metrics.jsonl
+# On exit, latency histograms and outcome counts are written to ./logs/<something>.metrics.json
+# Run metrics_summary.py on the .jsonl file to see them while samples are still being collected.
 
 set -o pipefail
 
 SSH_PID=0
-readonly SSH_PIPE="/tmp/ssh-input-for-pi"
 
 XYZ_OF_SAMP=""
 XYZ_OF_SAMPS=""
@@ -38,7 +50,6 @@ cleanup() {
 	if [ ${SSH_PID} -ne 0 ]; then
 		echo "Waiting for ssh" 2>&1 | tee /dev/fd/3
 		wait ${SSH_PID}
-		rm -f ${SSH_PIPE}
 	fi
 
 	if [ ${CALIBRATE} ]; then
@@ -53,41 +64,59 @@ cleanup() {
 		echo -n "${MOTOR_POS_SAMPS}" | tee /dev/fd/3
 		echo "])" | tee /dev/fd/3
 	fi
+
+	if [ ${METRICS} ] && [ -s "${METRICS_SAMPLES}" ]; then
+		python3 "${THISPATH}/metrics_summary.py" "${METRICS_SAMPLES}" "${METRICS_SUMMARY}"
+		echo "Metrics written to ${METRICS_SUMMARY}" | tee /dev/fd/3
+	fi
 	exit 0
 }
 
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
 trap cleanup SIGINT SIGTERM
 
 readonly THISPATH="$(dirname "$0")"
 readonly IMAGES="${THISPATH}/images"
-
-readonly USEPATH_ON_PI="/home/pi/repos/hp-mark/use"
+source "${THISPATH}/common.sh"
 
 readonly HPM="../hpm/hpm/hpm"
 #readonly CAMPARAMS="../hpm/hpm/example-cam-params/myExampleCamParams.xml"
 readonly CAMPARAMS="../hpm/hpm/example-cam-params/loDistCamParams2.xml"
 readonly MARKERPARAMS="../hpm/hpm/example-marker-params/my-marker-params.xml"
 
-readonly RASPISTILL="/home/pi/repos/NativePiCamera/bin/raspistill_CS_lens"
+readonly ENCODING="${ENCODING:-jpg}"
 SERIESNAME=$(mktemp --dry-run XXXXX)
 if [ ${DATA_SERIES_NAME} ]; then
 	SERIESNAME="${DATA_SERIES_NAME}"
 fi
 readonly LOGFILE="logs/${SERIESNAME}.log"
+readonly METRICS_SAMPLES="logs/${SERIESNAME}.metrics.jsonl"
+readonly METRICS_SUMMARY="logs/${SERIESNAME}.metrics.json"
 touch ${LOGFILE}
 exec 3>&1 1>>${LOGFILE} 2>&1
 
 readonly IMAGESERIES="${IMAGES}/${SERIESNAME}"
 mkdir -p "${IMAGESERIES}/"
 
-readonly IMAGESERIES_ON_PI="${USEPATH_ON_PI}/images/${SERIESNAME}"
+FAKE_IMAGES=()
+if [ ${FAKE_CAMERA} ]; then
+	find_fake_images "${FAKE_CAMERA}"
+fi
+readonly FAKE_IMAGES
 
 let "INC=1"
 COUNT=""
 
 while true; do
 
+	SAMPLE_METRICS=""
 	if [ ${CALIBRATE} ]; then
+		if [ ${METRICS} ]; then
+			STAGE_START_MS=$(now_ms)
+		fi
 		### M114 S2 ###
 		# WARNING: This does not work if the web interface is running... Close the tab first.
 		# Send the http request.
@@ -104,45 +133,55 @@ while true; do
 		sleep 0.1
 		MOTOR_POS_SAMP="$(curl --silent -X GET -H "application/json, text/plain, */*" http://duet3.local/rr_reply 2>&1 | tr -d '\n')"
 		echo -n ${MOTOR_POS_SAMP} | tee /dev/fd/3
+		if [ ${METRICS} ]; then
+			SAMPLE_METRICS+=", \"position_ms\": $(($(now_ms) - STAGE_START_MS))"
+		fi
 	fi
 
 	printf -v COUNT "%04d" ${INC}
-	IMAGE="${IMAGESERIES}/${COUNT}.jpg"
-	IMAGE_ON_PI="${IMAGESERIES_ON_PI}/${COUNT}.jpg"
-
-	rm -f ${SSH_PIPE}
-	mkfifo ${SSH_PIPE}
-	tail -f ${SSH_PIPE} | ssh pi@rpi RASPISTILL=${RASPISTILL} USEPATH_ON_PI=${USEPATH_ON_PI} IMAGE_ON_PI=${IMAGE_ON_PI} 'bash -s' 2>&1 | tee /dev/fd/3 &
-	SSH_PID=$!
-	PI_CMD="cd \"${USEPATH_ON_PI}\""
-	if [ ${VERBOSE} ]; then
-		PI_CMD+=" && pwd"
+
+	if [ ${METRICS} ]; then
+		STAGE_START_MS=$(now_ms)
 	fi
-	PI_CMD+=" && mkdir -p \"${IMAGESERIES_ON_PI}/\""
-	PI_CMD+=" && sudo python3 /home/pi/repos/rpi_ws281x/python/examples/tobben_constant_light.py > /dev/null"
-	PI_CMD+=" && "${RASPISTILL}" --quality 100 --timeout 300 --shutter 150000 --ISO 50 -o \"${IMAGE_ON_PI}\" --width 3280 --height 2464"
-	PI_CMD+=" && sudo python3 /home/pi/repos/rpi_ws281x/python/examples/lights_off.py > /dev/null"
-	if [ ${VERBOSE} ]; then
-		PI_CMD+=" && echo Captured image remotely: \"${IMAGE_ON_PI}\""
+	CAPTURE_STATUS=0
+	if [ ${FAKE_CAMERA} ]; then
+		if [ ${INC} -gt ${#FAKE_IMAGES[@]} ]; then
+			cleanup
+		fi
+		FAKE_IMAGE="${FAKE_IMAGES[$((INC - 1))]}"
+		IMAGE="${IMAGESERIES}/${COUNT}.${FAKE_IMAGE##*.}"
+		cp "${FAKE_IMAGE}" "${IMAGE}"
+		CAPTURE_STATUS=$?
+		if [ ${VERBOSE} ]; then
+			echo "Replayed ${FAKE_IMAGE}" 2>&1 | tee /dev/fd/3
+		fi
+	else
+		IMAGE="${IMAGESERIES}/${COUNT}.${ENCODING}"
+		capture_from_pi "${IMAGE}" 150000 "${ENCODING}"
+		CAPTURE_STATUS=$?
+		if [ ${VERBOSE} ]; then
+			echo "Captured image: ${IMAGE}" 2>&1 | tee /dev/fd/3
+		fi
 	fi
-	PI_CMD+="; exit"
-	echo ${PI_CMD} >>${SSH_PIPE}
-	wait ${SSH_PID}
-	SSH_PID=0
 
-	if [ ${VERBOSE} ]; then
-		echo "Copies home:" 2>&1 | tee /dev/fd/3
-		scp pi@rpi:${IMAGE_ON_PI} ${IMAGE} 2>&1 | tee /dev/fd/3
-	else
-		scp -q pi@rpi:${IMAGE_ON_PI} ${IMAGE} 2>&1 | tee /dev/fd/3
+	if [ ${METRICS} ]; then
+		CAPTURE_OUTCOME="ok"
+		if [ ${CAPTURE_STATUS} -ne 0 ] || [ ! -s "${IMAGE}" ]; then
+			CAPTURE_OUTCOME="failed"
+		fi
+		SAMPLE_METRICS+=", \"capture_ms\": $(($(now_ms) - STAGE_START_MS)), \"capture\": \"${CAPTURE_OUTCOME}\""
 	fi
 
 	COMMAND="${HPM} ${CAMPARAMS} ${MARKERPARAMS} ${IMAGE} $@"
 	if [ ${VERBOSE} ]; then
 		echo "${COMMAND}" 2>&1 | tee /dev/fd/3
 	fi
+	HPM_START_NS=$(date +%s%N)
 	XYZ_OF_SAMP="$($COMMAND 2>&1)"
+	HPM_STATUS=$?
+	HPM_MS=$((($(date +%s%N) - HPM_START_NS) / 1000000))
 	echo ${XYZ_OF_SAMP} | tee /dev/fd/3
+	log_hpm_latency ${HPM_MS} "${IMAGE}"
 
 	if ! [[ "${XYZ_OF_SAMP}" =~ .*Warning.* ]]; then
 		if [ "${XYZ_OF_SAMP}" != "Could not identify markers" ]; then
@@ -154,5 +193,18 @@ while true; do
 		fi
 	fi
 
+	if [ ${METRICS} ]; then
+		HPM_OUTCOME="ok"
+		if [ ${HPM_STATUS} -ne 0 ]; then
+			HPM_OUTCOME="failed"
+		elif [ "${XYZ_OF_SAMP}" == "Could not identify markers" ]; then
+			HPM_OUTCOME="no_markers"
+		elif [[ "${XYZ_OF_SAMP}" =~ .*Warning.* ]]; then
+			HPM_OUTCOME="warning"
+		fi
+		SAMPLE_METRICS+=", \"hpm_ms\": ${HPM_MS}, \"hpm\": \"${HPM_OUTCOME}\""
+		echo "{\"sample\": \"${COUNT}\"${SAMPLE_METRICS}}" >>"${METRICS_SAMPLES}"
+	fi
+
 	let "INC=INC+1"
 done